@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#include "bigcpm_ioctl.h"
+
+#define COLORS_PARAM "/sys/module/bigcpm/parameters/llc_colors"
+
+/* The driver's llc_colors parameter, 16 if it can't be read. */
+static unsigned long llc_colors(void)
+{
+	unsigned long colors = 16;
+	FILE *f = fopen(COLORS_PARAM, "r");
+
+	if (f) {
+		if (fscanf(f, "%lu", &colors) != 1)
+			colors = 16;
+		fclose(f);
+	}
+	return colors;
+}
+
+/* Physical address of every page of the buffer, malloc'd; *nents gets
+the count. */
+static __u64 *get_pages(int fd, __u64 handle, __u64 size, __u64 *nents)
+{
+	__u64 want = (size + getpagesize() - 1) / getpagesize();
+	bigcpm_sg_arg_t sg;
+	__u64 *paddrs;
+
+	sg.handle = handle;
+	sg.nents = want;
+	paddrs = malloc(sizeof(*paddrs) * want);
+	sg.paddrs = (unsigned long)paddrs;
+	if (!paddrs || ioctl(fd, BIGCPM_GET_SGLIST, &sg) == -1) {
+		printf("BIGCPM_GET_SGLIST failed: %s\n", strerror(errno));
+		free(paddrs);
+		return NULL;
+	}
+	*nents = sg.nents < want ? sg.nents : want;
+	return paddrs;
+}
+
+int main(int argc, char *argv[])
+{
+	char *file_name = "/dev/bigcpm";
+	bigcpm_alloc_arg_t a;
+	bigcpm_buf_arg_t b;
+	__u64 *paddrs, nents, i;
+	unsigned long colors, color;
+	int fd, c, failed = 0;
+
+	memset(&a, 0, sizeof(a));
+	a.size = 4 * 1024 * 1024;
+	while ((c = getopt(argc, argv, "s:c:a:l:h:")) != -1)
+		switch (c) {
+		case 's':	/* size in MB */
+			a.size = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'c':	/* colored, with this color mask */
+			a.flags |= BIGCPM_ALLOC_COLORED;
+			a.color_mask = strtoull(optarg, NULL, 0);
+			break;
+		case 'a':	/* physical alignment in bytes */
+			a.align = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':	/* lowest physical address */
+			a.phys_min = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':	/* highest physical address */
+			a.phys_max = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s MB] [-c color_mask] [-a align] [-l phys_min] [-h phys_max]\n",
+				argv[0]);
+			return 1;
+		}
+
+	fd = open(file_name, O_RDWR);
+	if (fd == -1) {
+		perror("apps open");
+		return 2;
+	}
+	if (ioctl(fd, BIGCPM_ALLOC_EX, &a) == -1) {
+		printf("BIGCPM_ALLOC_EX failed: %s\n", strerror(errno));
+		return 1;
+	}
+	paddrs = get_pages(fd, a.handle, a.size, &nents);
+	if (!paddrs)
+		return 1;
+	printf("handle %llu: %llu pages, first at 0x%llx\n",
+		(unsigned long long)a.handle, (unsigned long long)nents,
+		(unsigned long long)paddrs[0]);
+
+	if (a.align && paddrs[0] % a.align) {
+		printf("buffer at 0x%llx is not aligned to 0x%llx\n",
+			(unsigned long long)paddrs[0],
+			(unsigned long long)a.align);
+		failed = 1;
+	}
+	colors = llc_colors();
+	for (i = 0; i < nents; i++) {
+		if (paddrs[i] < a.phys_min || (a.phys_max &&
+		    paddrs[i] + getpagesize() - 1 > a.phys_max)) {
+			printf("page %llu at 0x%llx is outside 0x%llx..0x%llx\n",
+				(unsigned long long)i,
+				(unsigned long long)paddrs[i],
+				(unsigned long long)a.phys_min,
+				(unsigned long long)a.phys_max);
+			failed = 1;
+			break;
+		}
+		color = (paddrs[i] / getpagesize()) & (colors - 1);
+		if (a.flags & BIGCPM_ALLOC_COLORED &&
+		    !(a.color_mask & (1ULL << color))) {
+			printf("page %llu at 0x%llx has color %lu, not in 0x%llx\n",
+				(unsigned long long)i,
+				(unsigned long long)paddrs[i], color,
+				(unsigned long long)a.color_mask);
+			failed = 1;
+			break;
+		}
+	}
+
+	free(paddrs);
+	b.handle = a.handle;
+	ioctl(fd, BIGCPM_BUF_RELEASE, &b);
+	close(fd);
+	if (!failed)
+		printf("all pages as requested\n");
+	return failed;
+}
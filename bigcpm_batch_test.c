@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bigcpm_ioctl.h"
+
+#define NR_BUFS    16
+#define BUF_SIZE   (2*1024*1024)
+#define NR_GETS    64
+#define ROUNDS     1000
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Returns the number of failed ops, or -1 if the call itself failed. */
+static int run_batch(int fd, bigcpm_op_t *ops, unsigned int nops,
+		unsigned int flags)
+{
+	bigcpm_batch_arg_t b;
+
+	memset(&b, 0, sizeof(b));
+	b.ops = (unsigned long)ops;
+	b.nops = nops;
+	b.flags = flags;
+	if (ioctl(fd, BIGCPM_BATCH, &b) == -1) {
+		printf("BIGCPM_BATCH failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (b.failed)
+		printf("batch: %llu of %u ops run, %llu failed\n",
+			(unsigned long long)b.done, nops,
+			(unsigned long long)b.failed);
+	return b.failed;
+}
+
+/* Make ops[i] act on the handle allocated by ops[ref]. */
+static void ref_handle(bigcpm_op_t *ops, int i, __u64 op, int ref)
+{
+	ops[i].op = op;
+	ops[i].flags = BIGCPM_OP_REF_HANDLE;
+	ops[i].ref = ref;
+}
+
+int main(void)
+{
+	char *file_name = "/dev/bigcpm";
+	bigcpm_op_t ops[3 * NR_BUFS + 1], gets[NR_GETS];
+	bigcpm_alloc_arg_t a;
+	bigcpm_buf_arg_t b;
+	double t0, t1, t2;
+	int fd, i, r, failed = 0;
+
+	fd = open(file_name, O_RDWR);
+	if (fd == -1) {
+		perror("apps open");
+		return 2;
+	}
+
+	/* one call: allocate every buffer, look it up and release it,
+	the later ops naming their buffer by the op that allocated it */
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < NR_BUFS; i++) {
+		ops[i].op = BIGCPM_OP_ALLOC;
+		ops[i].alloc.size = BUF_SIZE;
+		ref_handle(ops, NR_BUFS + i, BIGCPM_OP_BUF_GET, i);
+		ref_handle(ops, 2 * NR_BUFS + i, BIGCPM_OP_BUF_RELEASE, i);
+	}
+	/* a reference to a later op is refused, and the batch carries on */
+	ref_handle(ops, 3 * NR_BUFS, BIGCPM_OP_BUF_GET, 3 * NR_BUFS);
+	if (run_batch(fd, ops, 3 * NR_BUFS + 1, BIGCPM_BATCH_CONTINUE) != 1)
+		failed = 1;
+	for (i = 0; i < NR_BUFS; i++) {
+		if (ops[i].result || ops[NR_BUFS + i].result ||
+		    ops[2 * NR_BUFS + i].result) {
+			printf("buffer %d: alloc %lld, get %lld, release %lld\n", i,
+				(long long)ops[i].result,
+				(long long)ops[NR_BUFS + i].result,
+				(long long)ops[2 * NR_BUFS + i].result);
+			failed = 1;
+		} else if (ops[NR_BUFS + i].buf.handle != ops[i].alloc.handle ||
+			   ops[NR_BUFS + i].buf.paddr != ops[i].alloc.paddr ||
+			   ops[NR_BUFS + i].buf.size != BUF_SIZE) {
+			printf("handle %llu: BUF_GET disagrees with ALLOC\n",
+				(unsigned long long)ops[i].alloc.handle);
+			failed = 1;
+		}
+	}
+	if (ops[3 * NR_BUFS].result != -EINVAL) {
+		printf("forward reference returned %lld\n",
+			(long long)ops[3 * NR_BUFS].result);
+		failed = 1;
+	}
+
+	/* lookups alone, NR_GETS per call against one ioctl each */
+	memset(&a, 0, sizeof(a));
+	a.size = BUF_SIZE;
+	if (ioctl(fd, BIGCPM_ALLOC_EX, &a) == -1) {
+		printf("BIGCPM_ALLOC_EX failed: %s\n", strerror(errno));
+		return 1;
+	}
+	memset(gets, 0, sizeof(gets));
+	for (i = 0; i < NR_GETS; i++) {
+		gets[i].op = BIGCPM_OP_BUF_GET;
+		gets[i].buf.handle = a.handle;
+	}
+	t0 = now();
+	for (r = 0; r < ROUNDS; r++)
+		if (run_batch(fd, gets, NR_GETS, 0))
+			return 1;
+	t1 = now();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < NR_GETS; i++) {
+			b.handle = a.handle;
+			if (ioctl(fd, BIGCPM_BUF_GET, &b) == -1) {
+				printf("BIGCPM_BUF_GET failed: %s\n", strerror(errno));
+				return 1;
+			}
+		}
+	t2 = now();
+	b.handle = a.handle;
+	ioctl(fd, BIGCPM_BUF_RELEASE, &b);
+
+	printf("%d lookups: %.2f us batched, %.2f us one ioctl each\n", NR_GETS,
+		(t1 - t0) * 1e6 / ROUNDS, (t2 - t1) * 1e6 / ROUNDS);
+	close(fd);
+	return failed;
+}
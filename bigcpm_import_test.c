@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "bigcpm_ioctl.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+
+int main(int argc, char *argv[])
+{
+	char *file_name = "/dev/bigcpm";
+	size_t size = 64 * 1024 * 1024;
+	int huge_flags = MAP_HUGETLB | MAP_HUGE_2MB;
+	bigcpm_import_arg_t im;
+	bigcpm_buf_arg_t b;
+	bigcpm_sg_arg_t sg;
+	__u64 *paddrs;
+	char *user, *dev;
+	size_t i;
+	int fd, c, failed = 0;
+
+	while ((c = getopt(argc, argv, "gns:")) != -1)
+		switch (c) {
+		case 'g':	/* 1 GB pages */
+			huge_flags = MAP_HUGETLB | MAP_HUGE_1GB;
+			break;
+		case 'n':	/* plain anonymous memory, to see it scattered */
+			huge_flags = 0;
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-g | -n] [-s MB]\n", argv[0]);
+			return 1;
+		}
+
+	user = mmap(0, size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE|huge_flags, -1, 0);
+	if (user == MAP_FAILED) {
+		printf("mmap of %zu MB failed: %s (huge pages reserved?)\n",
+			size >> 20, strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < size; i += 4096)
+		*(size_t *)(user + i) = i;
+
+	fd = open(file_name, O_RDWR);
+	if (fd == -1) {
+		perror("apps open");
+		return 2;
+	}
+	memset(&im, 0, sizeof(im));
+	im.addr = (unsigned long)user;
+	im.size = size;
+	if (ioctl(fd, BIGCPM_IMPORT, &im) == -1) {
+		printf("BIGCPM_IMPORT failed: %s%s\n", strerror(errno),
+			errno == ENOMEM ? " (ulimit -l too low?)" : "");
+		return 1;
+	}
+	printf("imported %zu MB as handle %llu: %llu runs, largest %llu KB, ",
+		size >> 20, (unsigned long long)im.handle,
+		(unsigned long long)im.nr_runs,
+		(unsigned long long)im.largest_run >> 10);
+	if (im.paddr)
+		printf("contiguous at 0x%llx\n", (unsigned long long)im.paddr);
+	else
+		printf("not contiguous\n");
+
+	b.handle = im.handle;
+	if (ioctl(fd, BIGCPM_BUF_GET, &b) == -1 || b.paddr != im.paddr ||
+	    b.size != size) {
+		printf("BIGCPM_BUF_GET disagrees with the import\n");
+		failed = 1;
+	}
+
+	paddrs = malloc(sizeof(*paddrs) * (size / 4096));
+	sg.handle = im.handle;
+	sg.nents = size / 4096;
+	sg.paddrs = (unsigned long)paddrs;
+	if (ioctl(fd, BIGCPM_GET_SGLIST, &sg) == -1) {
+		printf("BIGCPM_GET_SGLIST failed: %s\n", strerror(errno));
+		failed = 1;
+	} else
+		printf("first page at 0x%llx, last at 0x%llx\n",
+			(unsigned long long)paddrs[0],
+			(unsigned long long)paddrs[sg.nents - 1]);
+
+	/* the same memory, seen through the device */
+	dev = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+			BIGCPM_MMAP_OFFSET(im.handle));
+	if (dev == MAP_FAILED) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < size; i += 4096)
+		if (*(size_t *)(dev + i) != i) {
+			printf("mismatch at offset 0x%zx\n", i);
+			failed = 1;
+			break;
+		}
+	dev[1] = 0x5a;
+	if (user[1] != 0x5a) {
+		printf("write through the device mapping not seen\n");
+		failed = 1;
+	}
+	if (!failed)
+		printf("device mapping shares the imported pages\n");
+
+	munmap(dev, size);
+	ioctl(fd, BIGCPM_BUF_RELEASE, &b);
+	close(fd);
+	munmap(user, size);
+	free(paddrs);
+	return failed;
+}
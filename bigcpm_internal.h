@@ -0,0 +1,28 @@
+#ifndef BIGCPM_INTERNAL_H
+#define BIGCPM_INTERNAL_H
+
+/*
+ * Helpers shared by the bigcpmuser sources; not installed.
+ */
+
+#include <stdint.h>
+
+#define ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#else
+#define cpu_relax()	__atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/*
+ * Pools and rings are created in place in shared memory and attached by
+ * checking the header's magic with an acquire load. Store it last, with
+ * release, so an attacher that sees it also sees the rest of the header.
+ */
+static inline void publish_magic(uint32_t *magic, uint32_t value)
+{
+	__atomic_store_n(magic, value, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -1,15 +1,224 @@
 #ifndef BIGCPM_IOCTL_H
 #define BIGCPM_IOCTL_H
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
+/* Legacy argument; sized by unsigned long, so limited to 4 GB on 32-bit. */
 typedef struct
 {
     unsigned long paddr;                      /* out: physical address */
     unsigned long size;                       /* in: Memory size */
 } bigcpm_arg_t;
+
+/*
+ * The driver manages up to BIGCPM_MAX_BUFS buffers, named by handle.
+ * The legacy BIGCPM_ALLOC, BIGCMP_RELEASE and BIGCMP_GET_PHYSADDR act on
+ * buffer 0, which is kept for them: BIGCPM_ALLOC_EX and BIGCPM_IMPORT hand
+ * out handles from 1 up. To mmap buffer h, pass BIGCPM_MMAP_OFFSET(h) plus the offset
+ * within the buffer (32-bit applications need _FILE_OFFSET_BITS=64).
+ */
+#define BIGCPM_MAX_BUFS		64
+#define BIGCPM_MMAP_HANDLE_SHIFT	36
+#define BIGCPM_MMAP_OFFSET(h)	((unsigned long long)(h) << BIGCPM_MMAP_HANDLE_SHIFT)
+
+/*
+ * The buffer table is also published in a read-only page, mapped with
+ * mmap(NULL, page size, PROT_READ, MAP_SHARED, fd, BIGCPM_META_OFFSET).
+ * The driver bumps seq before and after every change, so seq is odd
+ * while an update is in progress; readers copy what they need and retry
+ * if seq was odd or has moved (see bigcpm_meta.h).
+ */
+#define BIGCPM_META_HANDLE	BIGCPM_MAX_BUFS
+#define BIGCPM_META_OFFSET	BIGCPM_MMAP_OFFSET(BIGCPM_META_HANDLE)
+#define BIGCPM_META_VERSION	1
+
+/* bigcpm_meta_entry_t flags */
+#define BIGCPM_META_COLORED	0x1	/* page list, paddr is 0: use BIGCPM_GET_SGLIST */
+#define BIGCPM_META_GIGANTIC	0x2	/* built from 1 GB chunks */
+#define BIGCPM_META_IMPORTED	0x4	/* user memory pinned by BIGCPM_IMPORT */
+
+typedef struct
+{
+    __u64 paddr;                              /* physical address, 0 if not contiguous */
+    __u64 size;                               /* buffer size, 0 if the slot is empty */
+    __u32 handle;                             /* buffer handle, the entry's index */
+    __s32 node;                               /* NUMA node of the first page, -1 if empty */
+    __u32 generation;                         /* bumped whenever the slot changes */
+    __u32 flags;                              /* BIGCPM_META_* */
+} bigcpm_meta_entry_t;
+
+typedef struct
+{
+    __u32 seq;                                /* odd while an update is in progress */
+    __u32 version;                            /* BIGCPM_META_VERSION */
+    __u32 nr_bufs;                            /* entries in bufs[] */
+    __u32 reserved;
+    __u64 generation;                         /* bumped on every change to the table */
+    __u64 reserved2;
+    bigcpm_meta_entry_t bufs[BIGCPM_MAX_BUFS];
+} bigcpm_meta_t;
+
+/* BIGCPM_ALLOC_EX flags */
+#define BIGCPM_ALLOC_COLORED	0x1	/* page list restricted to color_mask */
+#define BIGCPM_ALLOC_GIGANTIC	0x2	/* built from 1 GB aligned chunks (physical
+					   layout only: mmap still uses base pages);
+					   EOPNOTSUPP without CONFIG_CONTIG_ALLOC
+					   or before Linux 5.8 */
+#define BIGCPM_ALLOC_COMPACT	0x4	/* retry with compaction for up to timeout_ms,
+					   not with BIGCPM_ALLOC_COLORED */
+
+/*
+ * The structures below are made of __u64 only, so their layout is the
+ * same for 32-bit and 64-bit userspace.
+ */
+typedef struct
+{
+    __u64 paddr;                              /* out: physical address, 0 if not contiguous */
+    __u64 size;                               /* in: Memory size, below 64 GB */
+    __u64 flags;                              /* in: BIGCPM_ALLOC_* */
+    __u64 color_mask;                         /* in: allowed LLC colors, bit n = color n */
+    __u64 handle;                             /* out: buffer handle */
+    __u64 timeout_ms;                         /* in: BIGCPM_ALLOC_COMPACT budget, 0 = default */
+    __u64 align;                              /* in: physical alignment, power of two, 0 = default */
+    __u64 phys_min;                           /* in: lowest acceptable physical address */
+    __u64 phys_max;                           /* in: highest acceptable physical address, 0 = none */
+} bigcpm_alloc_arg_t;
+
+typedef struct
+{
+    __u64 handle;                             /* in: buffer handle */
+    __u64 paddr;                              /* out: physical address */
+    __u64 size;                               /* out: Memory size */
+} bigcpm_buf_arg_t;
+
+typedef struct
+{
+    __u64 handle;                             /* in: buffer handle */
+    __u64 nents;                              /* in: entries in paddrs, out: pages in buffer */
+    __u64 paddrs;                             /* in: user pointer to __u64 array, one per page */
+} bigcpm_sg_arg_t;
+
+/*
+ * BIGCPM_IMPORT pins an existing user range, e.g. hugetlbfs pages, and
+ * registers it as a buffer like any other: it can be mmapped through its
+ * handle, listed with BIGCPM_GET_SGLIST and appears in the metadata
+ * page. The pages stay pinned until the buffer is released and unmapped,
+ * and count against the caller's RLIMIT_MEMLOCK meanwhile: past it the
+ * import fails with ENOMEM, unless the caller has CAP_IPC_LOCK.
+ */
+typedef struct
+{
+    __u64 addr;                               /* in: user virtual address, page aligned */
+    __u64 size;                               /* in: bytes, a multiple of the page size */
+    __u64 handle;                             /* out: buffer handle */
+    __u64 paddr;                              /* out: physical address, 0 if not contiguous */
+    __u64 nr_runs;                            /* out: physically contiguous runs */
+    __u64 largest_run;                        /* out: bytes in the longest run */
+} bigcpm_import_arg_t;
+
+/*
+ * BIGCPM_QUERY verdicts: whether an allocation of the queried size and
+ * alignment should succeed. Higher is better.
+ */
+#define BIGCPM_QUERY_NO		0	/* not enough free or movable memory */
+#define BIGCPM_QUERY_COMPACT	1	/* only if compaction frees a run, see BIGCPM_ALLOC_COMPACT */
+#define BIGCPM_QUERY_NOW	2	/* a free run exists right now */
+
+typedef struct
+{
+    __s32 node;                               /* NUMA node */
+    __u32 zone;                               /* zone index within the node */
+    char  name[16];                           /* zone name, as in /proc/zoneinfo */
+    __u64 free_pages;                         /* free pages in the zone */
+    __u64 movable_pages;                      /* LRU pages compaction could move */
+    __u64 free_chunks;                        /* free max-order blocks */
+    __u64 largest_run;                        /* bytes in the longest run of free blocks */
+    __u64 verdict;                            /* BIGCPM_QUERY_* for this zone alone */
+} bigcpm_zone_info_t;
+
+typedef struct
+{
+    __u64 size;                               /* in: buffer size */
+    __u64 flags;                              /* in: BIGCPM_ALLOC_*, as for BIGCPM_ALLOC_EX */
+    __u64 align;                              /* in: physical alignment, as for BIGCPM_ALLOC_EX */
+    __u64 phys_min;                           /* in: lowest acceptable physical address */
+    __u64 phys_max;                           /* in: highest acceptable physical address, 0 = none */
+    __s64 node;                               /* in: NUMA node to look at, -1 = all */
+    __u64 nzones;                             /* in: entries in zones, out: zones examined */
+    __u64 zones;                              /* in: user pointer to bigcpm_zone_info_t array, or 0 */
+    __u64 verdict;                            /* out: best BIGCPM_QUERY_* over usable zones */
+    __u64 largest_run;                        /* out: longest free run in usable zones, bytes */
+} bigcpm_query_arg_t;
+
+/*
+ * BIGCPM_BATCH runs an array of operations in one call, in order. Each
+ * operation gets its own result; by default the batch stops at the first
+ * failure, with BIGCPM_BATCH_CONTINUE it carries on. Out fields of the
+ * argument are written back as by the single ioctl.
+ *
+ * With BIGCPM_OP_REF_HANDLE, a BUF_GET, BUF_RELEASE or GET_SGLIST takes
+ * its handle from the earlier ALLOC or IMPORT at index ref, so a buffer
+ * can be allocated and used in the same batch. The handle is filled in
+ * when the operation runs; it fails with ENOENT if that ALLOC or IMPORT
+ * failed.
+ */
+#define BIGCPM_OP_ALLOC		1	/* alloc: as BIGCPM_ALLOC_EX */
+#define BIGCPM_OP_BUF_GET	2	/* buf: as BIGCPM_BUF_GET */
+#define BIGCPM_OP_BUF_RELEASE	3	/* buf: as BIGCPM_BUF_RELEASE */
+#define BIGCPM_OP_GET_SGLIST	4	/* sg: as BIGCPM_GET_SGLIST */
+#define BIGCPM_OP_IMPORT	6	/* import: as BIGCPM_IMPORT */
+
+#define BIGCPM_BATCH_CONTINUE	0x1	/* don't stop at a failed operation */
+
+/* bigcpm_op_t flags */
+#define BIGCPM_OP_REF_HANDLE	0x1	/* handle from the operation at index ref */
+
+typedef struct
+{
+    __u64 op;                                 /* in: BIGCPM_OP_* */
+    __s64 result;                             /* out: 0 or -errno, untouched past done */
+    __u32 flags;                              /* in: BIGCPM_OP_* flags */
+    __u32 ref;                                /* in: index of an earlier op, see above */
+    union
+    {
+        bigcpm_alloc_arg_t alloc;
+        bigcpm_buf_arg_t buf;
+        bigcpm_sg_arg_t sg;
+        bigcpm_import_arg_t import;
+    };
+} bigcpm_op_t;
+
+typedef struct
+{
+    __u64 ops;                                /* in: user pointer to bigcpm_op_t array */
+    __u64 nops;                               /* in: entries in ops */
+    __u64 flags;                              /* in: BIGCPM_BATCH_* */
+    __u64 done;                               /* out: operations run */
+    __u64 failed;                             /* out: operations that failed */
+} bigcpm_batch_arg_t;
+
+typedef struct
+{
+    __u64 allocs;                             /* buffers allocated */
+    __u64 alloc_failures;                     /* allocation requests that failed */
+    __u64 compact_allocs;                     /* requests made with BIGCPM_ALLOC_COMPACT */
+    __u64 compact_helped;                     /* ... that succeeded only after compaction */
+    __u64 compact_retries;                    /* whole-allocation retries made by them */
+    __u64 range_rejects;                      /* chunks dropped for being outside phys_min/max */
+    /* A buffer released while still mapped counts only from its last munmap. */
+    __u64 free_pending;                       /* bytes released but not yet freed */
+} bigcpm_stats_t;
  
 #define  BIGCPM_ALLOC		_IOW('b', 1, unsigned long)
 #define  BIGCMP_RELEASE 	_IO('b',  2)
 #define  BIGCMP_GET_PHYSADDR  	_IOR('b', 3, unsigned long )
+#define  BIGCPM_ALLOC_EX	_IOWR('b', 4, bigcpm_alloc_arg_t)
+#define  BIGCPM_GET_SGLIST	_IOWR('b', 5, bigcpm_sg_arg_t)
+#define  BIGCPM_BUF_GET		_IOWR('b', 6, bigcpm_buf_arg_t)
+#define  BIGCPM_BUF_RELEASE	_IOW('b', 7, bigcpm_buf_arg_t)
+#define  BIGCPM_GET_STATS	_IOR('b', 8, bigcpm_stats_t)
+#define  BIGCPM_QUERY		_IOWR('b', 10, bigcpm_query_arg_t)
+#define  BIGCPM_BATCH		_IOWR('b', 11, bigcpm_batch_arg_t)
+#define  BIGCPM_IMPORT		_IOWR('b', 12, bigcpm_import_arg_t)
  
 #endif
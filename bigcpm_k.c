@@ -8,12 +8,35 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/errno.h>
+#include <linux/bitops.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/compat.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/mmzone.h>
+#include <linux/nodemask.h>
+#include <linux/vmstat.h>
+#include <linux/memory_hotplug.h>
+#include <linux/sort.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0))
+#include <linux/sched/signal.h>
+#include <linux/sched/mm.h>
+#endif
 #include <asm/uaccess.h>
 #include <asm/io.h>
 
 #include "debug_trace.h"
 #include "bigcpm_ioctl.h"
 
+/* Physical addresses at or above this don't fit a pfn in an unsigned long. */
+#define BIGCPM_PHYS_LIMIT ((u64) ULONG_MAX << PAGE_SHIFT)
+
 #define FIRST_MINOR 0
 #define MINOR_CNT 2
 
@@ -22,8 +45,6 @@ static dev_t dev;
 static struct cdev c_dev;
 static struct class *cl;
 
-static int allocated=0;
-
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_DESCRIPTION("BIG CPM Char Driver");
 
@@ -39,6 +60,27 @@ MODULE_DESCRIPTION("BIG CPM Char Driver");
 #define CHAPTER_PAGES (1 << CHAPTER_ORDER)	 /* pages in a chapter */
 #define CHAPTER_SIZE (PAGE_SIZE * CHAPTER_PAGES) /* chapter size in bytes */
 
+/* Gigantic chunk: 1 GB, naturally aligned, from alloc_contig_range */
+
+#define GIGANTIC_ORDER (30 - PAGE_SHIFT)	 /* page order of a gigantic chunk */
+#define GIGANTIC_PAGES (1UL << GIGANTIC_ORDER)	 /* pages in a gigantic chunk */
+
+/* alloc_contig_range is exported to modules from 5.8 (alloc_contig_pages
+never is); without it BIGCPM_ALLOC_GIGANTIC is not supported. */
+#if defined(CONFIG_CONTIG_ALLOC) && (LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0))
+#define HAVE_GIGANTIC
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0))
+#define totalram_pages() totalram_pages
+#endif
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0))
+#define pfn_to_online_page(pfn) (pfn_valid(pfn) ? pfn_to_page(pfn) : NULL)
+#endif
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0))
+#define strscpy strlcpy
+#endif
+
 
 /*
 * We join adjacent chapters into clusters, keeping track of allocations
@@ -57,11 +99,13 @@ ulong page_count;	/* number of pages */
 
 struct cluster_set {
 struct list_head clusters;	/* allocated clusters */
+ulong chunk_pages;	/* pages per allocation unit */
 };
 
-/* Declare and initialize a cluster set. */
-#define CLUSTER_SET(name) \
-struct cluster_set name = { clusters: LIST_HEAD_INIT(name.clusters) }
+/* Declare and initialize a cluster set of chunk_pages sized units. */
+#define CLUSTER_SET(name, pages) \
+struct cluster_set name = { clusters: LIST_HEAD_INIT(name.clusters), \
+			chunk_pages: pages }
 
 /* Retrieve the cluster from it's list head. */
 static struct cluster *get_cluster(struct list_head *node)
@@ -91,31 +135,31 @@ static struct list_head *find_insert_location(
 	return &set->clusters;
 }
 
-/* Try to merge a new chapter by prepending it to the cluster at pos.
+/* Try to merge a run of count pages by prepending it to the cluster at pos.
 Return true on success, false if unable to merge. */
-static bool try_prepend(
-struct cluster_set *set, struct list_head *pos, ulong chapter_start)
+static bool try_prepend(struct cluster_set *set, struct list_head *pos,
+			ulong chapter_start, ulong count)
 {
 	if (pos != &set->clusters) {
 		struct cluster *cl = get_cluster(pos);
-		if (chapter_start + CHAPTER_PAGES == cl->page_first) {
+		if (chapter_start + count == cl->page_first) {
 			cl->page_first = chapter_start;
-			cl->page_count += CHAPTER_PAGES;
+			cl->page_count += count;
 		return true;
 		}
 	}
 	return false;
 }
 
-/* Try to merge a new chapter by appending it to cluster at pos.
+/* Try to merge a run of count pages by appending it to cluster at pos.
 Return true on success, false if unable to merge. */
-static bool try_append(
-struct cluster_set *set, struct list_head *pos, ulong chapter_start)
+static bool try_append(struct cluster_set *set, struct list_head *pos,
+			ulong chapter_start, ulong count)
 {
 	if (pos != &set->clusters) {
 		struct cluster *cl = get_cluster(pos);
 		if (cl->page_first + cl->page_count == chapter_start) {
-			cl->page_count += CHAPTER_PAGES;
+			cl->page_count += count;
 		return true;
 		}
 	}
@@ -139,31 +183,37 @@ static void try_merge_prev(struct cluster_set *set, struct cluster *pos)
 	}
 }
 
-/* Account for another chapter allocation, returning the cluster it became
-part of. Returns NULL on error (out of memory). */
-static struct cluster *add_alloc(struct cluster_set *set,
-				struct page *new_chapter)
+/* Account for a run of count pages starting at pfn chapter_start, returning
+the cluster it became part of. Returns NULL on error (out of memory). */
+static struct cluster *add_run(struct cluster_set *set,
+				ulong chapter_start, ulong count)
 {
-	ulong chapter_start = page_to_pfn(new_chapter);
-
 	struct list_head *insert_loc = find_insert_location(set, chapter_start);
-	if (try_prepend(set, insert_loc, chapter_start)) {
+	if (try_prepend(set, insert_loc, chapter_start, count)) {
 	struct cluster *cl = get_cluster(insert_loc);
 	try_merge_prev(set, cl);
 	return cl;
-	} else if (try_append(set, insert_loc->prev, chapter_start)) {
+	} else if (try_append(set, insert_loc->prev, chapter_start, count)) {
 	return get_cluster(insert_loc->prev);
 	} else {
-	struct cluster *new_cluster = kmalloc(GFP_KERNEL, sizeof(*new_cluster));
+	struct cluster *new_cluster = kmalloc(sizeof(*new_cluster), GFP_KERNEL);
 	if (new_cluster) {
 		new_cluster->page_first = chapter_start;
-		new_cluster->page_count = CHAPTER_PAGES;
+		new_cluster->page_count = count;
 		list_add_tail(&new_cluster->head, insert_loc);
 	}
 	return new_cluster;
 	}
 }
 
+/* Account for another chapter allocation, returning the cluster it became
+part of. Returns NULL on error (out of memory). */
+static struct cluster *add_alloc(struct cluster_set *set,
+				struct page *new_chapter)
+{
+	return add_run(set, page_to_pfn(new_chapter), set->chunk_pages);
+}
+
 /* Give up count chapters starting at start. */
 static void free_chapters(struct page *start, unsigned long count)
 {
@@ -171,7 +221,35 @@ static void free_chapters(struct page *start, unsigned long count)
 	TRACEF("Freeing %lu chapters @ 0x%lx.\n", count, (ulong) page_to_phys(start));
 	for (i = 0; i < count; i++, start = nth_page(start, CHAPTER_PAGES)) {
 		__free_pages(start, CHAPTER_ORDER);
+		cond_resched();
+	}
+}
+
+/* Give up count pages of gigantic chunks starting at start. */
+static void free_gigantic(struct page *start, unsigned long count)
+{
+#ifdef HAVE_GIGANTIC
+	unsigned long pfn = page_to_pfn(start), end = pfn + count;
+#endif
+
+	TRACEF("Freeing %lu gigantic pages @ 0x%llx.\n", count / GIGANTIC_PAGES,
+		(unsigned long long) page_to_phys(start));
+#ifdef HAVE_GIGANTIC
+	for (; pfn < end; pfn += GIGANTIC_PAGES) {
+		free_contig_range(pfn, min(end - pfn, GIGANTIC_PAGES));
+		cond_resched();
 	}
+#endif
+}
+
+/* Give up a run of count pages made of the set's chunks. */
+static void free_chunks(struct cluster_set *set, struct page *start,
+			unsigned long count)
+{
+	if (set->chunk_pages == GIGANTIC_PAGES)
+		free_gigantic(start, count);
+	else
+		free_chapters(start, count / CHAPTER_PAGES);
 }
 
 /* Free the set and all clusters allocated to it. */
@@ -180,7 +258,7 @@ static void free_set(struct cluster_set *set)
 	struct cluster *pos, *t;
 	TRACEF("Freeing clusters.\n");
 	list_for_each_entry_safe(pos, t, &set->clusters, head) {
-	free_chapters(pfn_to_page(pos->page_first), pos->page_count / CHAPTER_PAGES);
+	free_chunks(set, pfn_to_page(pos->page_first), pos->page_count);
 	kfree(pos);
 }
 }
@@ -192,9 +270,9 @@ static void list_allocs(struct cluster_set *set)
 	TRACEF("Allocations in ascending order:\n");
 
 	list_for_each_entry(cluster, &set->clusters, head) {
-		TRACEF("Cluster from 0x%08lx .. 0x%08lx (%lu pages).\n",
-		(ulong) phys_start(cluster),
-		(ulong) phys_end(cluster),
+		TRACEF("Cluster from 0x%08llx .. 0x%08llx (%lu pages).\n",
+		(unsigned long long) phys_start(cluster),
+		(unsigned long long) phys_end(cluster),
 		cluster->page_count);
 	}
 }
@@ -205,67 +283,745 @@ static void unlink_cluster(struct cluster_set *set, struct cluster *cl)
 	list_del_init(&cl->head);
 }
 
-/* Allocate a big buffer of given size [bytes]. flags as in alloc_pages. */
-struct page *bigbuf_alloc(unsigned int flags, ulong size)
+#ifndef __GFP_RETRY_MAYFAIL
+#define __GFP_RETRY_MAYFAIL __GFP_REPEAT
+#endif
+
+#define COMPACT_BACKOFF_MS 20	/* pause between compaction retries */
+#define REJECT_SHIFT 1		/* park at most totalram >> this out of window */
+
+/*
+* Allocation policy. With compact set, an allocation the page allocator
+* can't satisfy straight away gives back everything it harvested and is
+* retried as a whole with __GFP_RETRY_MAYFAIL, which makes every chunk
+* run direct compaction and reclaim at its order, until deadline
+* (jiffies) passes. align_pages (0 or a power of two) is the physical
+* alignment the buffer must have, and every chunk must lie inside
+* [pfn_min, pfn_max] so devices with a narrow DMA mask can reach it.
+* Chunks outside the window are held until the allocation ends; parked
+* counts their pages so the search gives up before it drains the system.
+*/
+struct alloc_policy {
+	ulong align_pages;
+	ulong pfn_min;
+	ulong pfn_max;
+	bool compact;
+	unsigned long deadline;
+	unsigned long compacted;	/* out: whole-allocation retries made */
+	unsigned long rejected;		/* out: chunks outside the pfn window */
+	ulong parked;			/* pages held on the rejects list */
+};
+
+/* Sizes a buffer may have: nonzero, and below the mmap offsets of the
+next slot (BIGCPM_MMAP_OFFSET), which also keeps chunk rounding from
+wrapping around. */
+static bool size_ok(u64 size)
 {
-	int order = size ? get_order(size) : 0;
+	return size && size < BIGCPM_MMAP_OFFSET(1);
+}
 
-	if (order <= CHAPTER_ORDER) {
-		return alloc_pages(flags, order);
-	} else {
-		struct page *result;
+/* Whether a buffer of size bytes (nonzero) fits the physical window
+[phys_min, phys_max]; phys_max 0 means no upper limit. */
+static bool window_ok(u64 size, u64 phys_min, u64 phys_max)
+{
+	if (phys_min >= BIGCPM_PHYS_LIMIT)
+		return false;
+	return !phys_max || (phys_max >= phys_min &&
+			phys_max >= PAGE_SIZE - 1 &&
+			size - 1 <= phys_max - phys_min);
+}
 
-		int chapters = (size + CHAPTER_SIZE - 1) / CHAPTER_SIZE;
-		CLUSTER_SET(allocation_set);
-		struct cluster *merged;
+/* Set the policy's pfn window from a physical window window_ok() passed. */
+static void policy_set_window(struct alloc_policy *policy, u64 phys_min,
+			u64 phys_max)
+{
+	policy->pfn_min = PFN_UP(phys_min);
+	policy->pfn_max = ~0UL;
+	if (phys_max && phys_max < BIGCPM_PHYS_LIMIT)
+		policy->pfn_max = ((phys_max + 1) >> PAGE_SHIFT) - 1;
+}
 
-		TRACEF("Allocate huge block of size %lu (%i chapters).\n", size, chapters);
+#ifdef CONFIG_ZONE_DMA
+/* First pfn past ZONE_DMA on every online node. */
+static ulong zone_dma_end(void)
+{
+	ulong end = 0;
+	int nid;
 
-		do {
-			struct page *chapter = alloc_pages(flags, CHAPTER_ORDER);
-			if (!chapter)
-			goto fail;
-			TRACEF("Allocated chapter @ %lx.\n",
-			(ulong) page_to_phys(chapter));
-			merged = add_alloc(&allocation_set, chapter);
-			if (!merged)
-				goto fail;
-			list_allocs(&allocation_set);
-		} while (merged->page_count < chapters * CHAPTER_PAGES);
-
-		unlink_cluster(&allocation_set, merged);
-		TRACEF("After taking result:\n");
-		list_allocs(&allocation_set);
-		free_set(&allocation_set);
-		result = pfn_to_page(merged->page_first);
-		kfree(merged);
-		return result;
-	fail:
-		free_set(&allocation_set);
-		TRACEF("Allocation failed.\n");
+	for_each_online_node(nid) {
+		struct zone *zone = &NODE_DATA(nid)->node_zones[ZONE_DMA];
+
+		if (populated_zone(zone))
+			end = max(end, zone_end_pfn(zone));
+	}
+	return end;
+}
+#endif
+
+/* GFP flags limited to the zones that can satisfy the pfn window. A
+window that ends inside ZONE_DMA must be served from it; other zones
+would only yield chunks to park as rejects. */
+static unsigned int policy_gfp(struct alloc_policy *policy)
+{
+	unsigned int flags = GFP_KERNEL | __GFP_HIGHMEM;
+
+#ifdef CONFIG_ZONE_DMA
+	if (policy->pfn_max < zone_dma_end())
+		return GFP_KERNEL | __GFP_DMA;
+#endif
+#ifdef CONFIG_ZONE_DMA32
+	if (policy->pfn_max <= (0xffffffffULL >> PAGE_SHIFT))
+		return GFP_KERNEL | __GFP_DMA32;
+#endif
+#ifdef CONFIG_HIGHMEM
+	if (policy->pfn_max < PFN_DOWN(__pa(high_memory)))
+		flags &= ~__GFP_HIGHMEM;
+#endif
+	return flags;
+}
+
+#ifdef HAVE_GIGANTIC
+/* Could [pfn, pfn + GIGANTIC_PAGES) go to alloc_contig_range? These are
+the checks alloc_contig_pages makes before trying a range. */
+static bool gigantic_range_ok(struct zone *zone, ulong pfn)
+{
+	ulong i;
+
+	for (i = pfn; i < pfn + GIGANTIC_PAGES; i++) {
+		struct page *page = pfn_to_online_page(i);
+
+		if (!page || page_zone(page) != zone || PageReserved(page))
+			return false;
+	}
+	return true;
+}
+
+/* Try the aligned 1 GB ranges inside [pfn_min, pfn_max] of the node's
+zones that flags allow, highest zone first like the page allocator. */
+static struct page *alloc_gigantic_node(int nid, unsigned int flags,
+			ulong pfn_min, ulong pfn_max)
+{
+	int z;
+
+	for (z = gfp_zone(flags); z >= 0; z--) {
+		struct zone *zone = &NODE_DATA(nid)->node_zones[z];
+		ulong pfn = ALIGN(max(zone->zone_start_pfn, pfn_min),
+				GIGANTIC_PAGES);
+		ulong end = zone_end_pfn(zone);
+
+		if (!populated_zone(zone))
+			continue;
+		if (pfn_max < end - 1)
+			end = pfn_max + 1;
+		for (; pfn < end && end - pfn >= GIGANTIC_PAGES;
+		     pfn += GIGANTIC_PAGES) {
+			if (gigantic_range_ok(zone, pfn) &&
+			    !alloc_contig_range(pfn, pfn + GIGANTIC_PAGES,
+					MIGRATE_MOVABLE, flags))
+				return pfn_to_page(pfn);
+			cond_resched();
+		}
+	}
+	return NULL;
+}
+#endif
+
+/* Allocate one gigantic chunk inside the policy's pfn window (policy may
+be NULL), local node first. NULL if the kernel can't provide them. */
+static struct page *alloc_gigantic(unsigned int flags,
+			struct alloc_policy *policy)
+{
+#ifdef HAVE_GIGANTIC
+	ulong pfn_min = policy ? policy->pfn_min : 0;
+	ulong pfn_max = policy ? policy->pfn_max : ~0UL;
+	int nid, local = numa_node_id();
+	struct page *page;
+
+	page = alloc_gigantic_node(local, flags, pfn_min, pfn_max);
+	if (page)
+		return page;
+	for_each_online_node(nid) {
+		if (nid == local)
+			continue;
+		page = alloc_gigantic_node(nid, flags, pfn_min, pfn_max);
+		if (page)
+			return page;
+	}
+#endif
+	return NULL;
+}
+
+static struct page *alloc_chunk(unsigned int flags, unsigned int order,
+			struct alloc_policy *policy)
+{
+	if (order == GIGANTIC_ORDER)
+		return alloc_gigantic(flags, policy);
+	return alloc_pages(flags, order);
+}
+
+/* Does the chunk of order at page lie inside the policy's pfn window? */
+static bool chunk_in_range(struct alloc_policy *policy, struct page *chunk,
+			unsigned int order)
+{
+	ulong pfn = page_to_pfn(chunk);
+
+	return !policy || (pfn >= policy->pfn_min &&
+			pfn + (1UL << order) - 1 <= policy->pfn_max);
+}
+
+/* Allocate a chunk that satisfies policy. Chunks outside the pfn window
+are parked on rejects instead of being freed, so the allocator moves on
+to other memory; the caller gives them back with free_rejects. Once a
+chunk has been rejected the allocator is told not to reclaim or invoke
+the OOM killer for the window's sake, and the search fails when the
+parked pages reach a share of RAM. */
+static struct page *alloc_chunk_policy(unsigned int flags, unsigned int order,
+			struct alloc_policy *policy, struct list_head *rejects)
+{
+	struct page *chunk;
+
+	if (policy && policy->parked)
+		flags |= __GFP_NORETRY | __GFP_NOWARN;
+	while ((chunk = alloc_chunk(flags, order, policy))) {
+		if (chunk_in_range(policy, chunk, order))
+			break;
+		TRACEF("Rejected chunk @ %llx.\n",
+			(unsigned long long) page_to_phys(chunk));
+		list_add(&chunk->lru, rejects);
+		policy->rejected++;
+		policy->parked += 1UL << order;
+		if (policy->parked > totalram_pages() >> REJECT_SHIFT)
+			return NULL;
+		flags |= __GFP_NORETRY | __GFP_NOWARN;
+		cond_resched();
+	}
+	return chunk;
+}
+
+static void free_rejects(struct list_head *rejects, unsigned int order,
+			struct alloc_policy *policy)
+{
+	struct page *page, *t;
+
+	if (policy)
+		policy->parked = 0;
+
+	list_for_each_entry_safe(page, t, rejects, lru) {
+		list_del(&page->lru);
+		if (order == GIGANTIC_ORDER)
+			free_gigantic(page, GIGANTIC_PAGES);
+		else
+			__free_pages(page, order);
+	}
+}
+
+/* Look for a window of pages pages aligned to align_pages inside cl.
+Returns true and the window's first pfn in start if there is one. */
+static bool find_window(struct cluster *cl, ulong pages, ulong align_pages,
+			ulong *start)
+{
+	ulong first = align_pages ? ALIGN(cl->page_first, align_pages) :
+			cl->page_first;
+
+	if (first + pages > cl->page_first + cl->page_count)
+		return false;
+	*start = first;
+	return true;
+}
+
+/* Shrink cl to the window at start, giving back the chunks around it. */
+static void trim_cluster(struct cluster_set *set, struct cluster *cl,
+			ulong start, ulong pages)
+{
+	ulong head = start - cl->page_first;
+	ulong tail = cl->page_first + cl->page_count - (start + pages);
+
+	if (head)
+		free_chunks(set, pfn_to_page(cl->page_first), head);
+	if (tail)
+		free_chunks(set, pfn_to_page(start + pages), tail);
+	cl->page_first = start;
+	cl->page_count = pages;
+}
+
+/* Harvest chunks into set until one cluster holds a window of pages
+pages with the policy's alignment, then keep that window and give back
+the rest. */
+static struct page *harvest(struct cluster_set *set, unsigned int flags,
+			ulong pages, struct alloc_policy *policy)
+{
+	unsigned int order = set->chunk_pages == GIGANTIC_PAGES ?
+			GIGANTIC_ORDER : CHAPTER_ORDER;
+	ulong align_pages = policy ? policy->align_pages : 0;
+	LIST_HEAD(rejects);
+	struct page *result;
+	struct cluster *merged;
+	ulong start;
+
+	if (!pages)
 		return NULL;
+	do {
+		struct page *chunk = alloc_chunk_policy(flags, order, policy,
+						&rejects);
+		if (!chunk)
+		goto fail;
+		TRACEF("Allocated chunk @ %llx.\n",
+		(unsigned long long) page_to_phys(chunk));
+		merged = add_alloc(set, chunk);
+		if (!merged) {
+			free_chunks(set, chunk, set->chunk_pages);
+			goto fail;
+		}
+		list_allocs(set);
+	} while (!find_window(merged, pages, align_pages, &start));
+
+	unlink_cluster(set, merged);
+	trim_cluster(set, merged, start, pages);
+	TRACEF("After taking result:\n");
+	list_allocs(set);
+	free_set(set);
+	free_rejects(&rejects, order, policy);
+	result = pfn_to_page(merged->page_first);
+	kfree(merged);
+	return result;
+fail:
+	free_set(set);
+	free_rejects(&rejects, order, policy);
+	TRACEF("Allocation failed.\n");
+	return NULL;
+}
+
+/* Pages covered by size bytes rounded up to whole chunks of chunk_order. */
+static inline ulong chunk_round_pages(u64 size, unsigned int chunk_order)
+{
+	return (ulong) ((size + (PAGE_SIZE << chunk_order) - 1) >>
+			(PAGE_SHIFT + chunk_order)) << chunk_order;
+}
+
+/* Allocate a big buffer of given size [bytes]. flags as in alloc_pages,
+policy may be NULL. Up to a chapter, buffers are aligned to their order;
+callers wanting more than that must round size up to the alignment. */
+struct page *bigbuf_alloc(unsigned int flags, u64 size,
+			struct alloc_policy *policy)
+{
+	if (size <= CHAPTER_SIZE &&
+	    (!policy || policy->align_pages <= CHAPTER_PAGES)) {
+		unsigned int order = size ? get_order(size) : 0;
+		LIST_HEAD(rejects);
+		struct page *page;
+
+		page = alloc_chunk_policy(flags, order, policy, &rejects);
+		free_rejects(&rejects, order, policy);
+		return page;
+	} else {
+		CLUSTER_SET(allocation_set, CHAPTER_PAGES);
+		ulong pages = chunk_round_pages(size, CHAPTER_ORDER);
+
+		if (!pages)	/* size wrapped around */
+			return NULL;
+		TRACEF("Allocate huge block of size %llu (%lu chapters).\n",
+			(unsigned long long) size, pages / CHAPTER_PAGES);
+		return harvest(&allocation_set, flags, pages, policy);
 	} /* else */
 }
 
 /* Free a buffer allocates by bigbuf_alloc. */
-void bigbuf_free(struct page *start, ulong size)
+void bigbuf_free(struct page *start, u64 size)
 {
-	int size_order = size ? get_order(size) : 0;
-	if (size_order < CHAPTER_ORDER) {
-		__free_pages(start, size_order);
+	if (size <= CHAPTER_SIZE) {
+		__free_pages(start, size ? get_order(size) : 0);
 	} else {
-	free_chapters(start, (size + CHAPTER_SIZE - 1) / CHAPTER_SIZE);
+	free_chapters(start, chunk_round_pages(size, CHAPTER_ORDER) / CHAPTER_PAGES);
+	}
+}
+
+/* Allocate a big buffer from 1 GB gigantic chunks. */
+struct page *bigbuf_alloc_gigantic(unsigned int flags, u64 size,
+			struct alloc_policy *policy)
+{
+	CLUSTER_SET(allocation_set, GIGANTIC_PAGES);
+	ulong pages = chunk_round_pages(size, GIGANTIC_ORDER);
+
+	TRACEF("Allocate gigantic block of size %llu (%lu GB).\n",
+		(unsigned long long) size, pages / GIGANTIC_PAGES);
+	return harvest(&allocation_set, flags, pages, policy);
+}
+
+/* Free a buffer allocated by bigbuf_alloc_gigantic. */
+void bigbuf_free_gigantic(struct page *start, u64 size)
+{
+	free_gigantic(start, chunk_round_pages(size, GIGANTIC_ORDER));
+}
+
+static struct page *bigbuf_alloc_any(unsigned int flags, u64 size,
+			bool gigantic, struct alloc_policy *policy)
+{
+	if (gigantic)
+		return bigbuf_alloc_gigantic(flags, size, policy);
+	return bigbuf_alloc(flags, size, policy);
+}
+
+/* Allocate a block, applying the policy's compaction budget. A failed
+attempt has already given back every chunk it harvested, so each retry
+compacts with all of free memory to move pages into. */
+static struct page *bigbuf_alloc_compact(unsigned int flags, u64 size,
+			bool gigantic, struct alloc_policy *policy)
+{
+	struct page *block;
+
+	if (!policy->compact)
+		return bigbuf_alloc_any(flags, size, gigantic, policy);
+
+	block = bigbuf_alloc_any(flags | __GFP_NOWARN, size, gigantic, policy);
+	while (!block && time_before(jiffies, policy->deadline) &&
+	       !fatal_signal_pending(current)) {
+		policy->compacted++;
+		block = bigbuf_alloc_any(flags | __GFP_RETRY_MAYFAIL |
+				__GFP_NOWARN, size, gigantic, policy);
+		if (!block)
+			/* let kcompactd and reclaim make progress */
+			msleep(COMPACT_BACKOFF_MS);
 	}
+	return block;
+}
+
+/*
+* Feasibility estimates. A zone is walked at chapter stride looking for
+* free max-order buddy blocks, the chunks harvest() would be handed, and
+* runs of adjacent ones are measured. Nothing is allocated and zone->lock
+* isn't taken, so the answer is a snapshot that may already be stale.
+*/
+
+/* Pages on the LRU, which compaction could migrate out of the way. */
+static ulong zone_movable_pages(struct zone *zone)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0))
+	return zone_page_state(zone, NR_ZONE_INACTIVE_ANON) +
+		zone_page_state(zone, NR_ZONE_ACTIVE_ANON) +
+		zone_page_state(zone, NR_ZONE_INACTIVE_FILE) +
+		zone_page_state(zone, NR_ZONE_ACTIVE_FILE);
+#else
+	return zone_page_state(zone, NR_INACTIVE_ANON) +
+		zone_page_state(zone, NR_ACTIVE_ANON) +
+		zone_page_state(zone, NR_INACTIVE_FILE) +
+		zone_page_state(zone, NR_ACTIVE_FILE);
+#endif
 }
 
-typedef struct bigcpmdev_info {
-  unsigned int   size;
+/* Does the zone have a free block of at least order? */
+static bool zone_has_order(struct zone *zone, unsigned int order)
+{
+	for (; order < MAX_ORDER; order++)
+		if (READ_ONCE(zone->free_area[order].nr_free))
+			return true;
+	return false;
+}
+
+static bool zone_in_window(struct zone *zone, struct alloc_policy *policy)
+{
+	return zone->zone_start_pfn <= policy->pfn_max &&
+		zone_end_pfn(zone) > policy->pfn_min;
+}
+
+/* Is the chapter at pfn a free buddy block right now? pfn_valid() also
+holds for offline sections, whose struct pages are not initialized. */
+static bool chapter_free(ulong pfn)
+{
+	struct page *page = pfn_to_online_page(pfn);
+
+	return page && PageBuddy(page) && page_private(page) >= CHAPTER_ORDER;
+}
+
+/*
+* Count the zone's free chapters inside the policy's pfn window and find
+* the longest run of them. Returns whether some run holds pages pages
+* starting on an align_pages boundary.
+*/
+static bool scan_zone(struct zone *zone, ulong pages, ulong align_pages,
+			struct alloc_policy *policy, ulong *free_chunks,
+			ulong *largest_run)
+{
+	ulong pfn = ALIGN(max(zone->zone_start_pfn, policy->pfn_min),
+			CHAPTER_PAGES);
+	ulong end = zone_end_pfn(zone);
+	ulong run_start = 0, run = 0;
+	bool fits = false;
+
+	if (policy->pfn_max < end - 1)
+		end = policy->pfn_max + 1;
+	*free_chunks = *largest_run = 0;
+	for (; pfn < end && end - pfn >= CHAPTER_PAGES; pfn += CHAPTER_PAGES) {
+		if (!chapter_free(pfn)) {
+			run = 0;
+		} else {
+			if (!run)
+				run_start = pfn;
+			run += CHAPTER_PAGES;
+			(*free_chunks)++;
+			*largest_run = max(*largest_run, run);
+			if (ALIGN(run_start, align_pages) + pages <= pfn + CHAPTER_PAGES)
+				fits = true;
+		}
+		if (!(pfn & ((CHAPTER_PAGES << 10) - 1)))
+			cond_resched();
+	}
+	return fits;
+}
+
+/*
+* Cache coloring: with a physically indexed LLC, the pfn bits just above
+* the page offset decide which slice of the cache ("color") a page maps
+* to. llc_colors should be LLC size / (ways * PAGE_SIZE).
+*/
+static ulong llc_colors = 16;
+module_param(llc_colors, ulong, S_IRUGO);
+MODULE_PARM_DESC(llc_colors, "Number of LLC page colors (power of two)");
+
+static inline ulong page_color(struct page *page)
+{
+	return page_to_pfn(page) & (llc_colors - 1);
+}
+
+/* Fill pages[] with count pages whose color is set in color_mask.
+Pages of other colors are held until the end, so the buddy allocator
+keeps handing out new ones. Allocations don't retry, so running low on
+memory ends in -ENOMEM instead of the OOM killer. Returns 0 or -errno. */
+static int colored_alloc(unsigned int flags, struct page **pages,
+			ulong count, ulong color_mask, struct alloc_policy *policy)
+{
+	LIST_HEAD(rejects);
+	struct page *page, *t;
+	ulong n = 0, nr_rejects = 0;
+	int ret = 0;
+
+	if (!is_power_of_2(llc_colors) || llc_colors > BITS_PER_LONG)
+		return -EINVAL;
+	if (llc_colors < BITS_PER_LONG)
+		color_mask &= (1UL << llc_colors) - 1;
+	if (!color_mask)
+		return -EINVAL;
+
+	while (n < count) {
+		page = alloc_page(flags | __GFP_NORETRY | __GFP_NOWARN);
+		if (!page) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (chunk_in_range(policy, page, 0) &&
+		    color_mask & (1UL << page_color(page))) {
+			pages[n++] = page;
+		} else {
+			if (!chunk_in_range(policy, page, 0))
+				policy->rejected++;
+			list_add(&page->lru, &rejects);
+			/* give up rather than eat all of memory, whether the
+			page had the wrong color or lay outside the window */
+			if (++nr_rejects > count * llc_colors) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		if (!((n + nr_rejects) % CHAPTER_PAGES))
+			cond_resched();
+	}
+	TRACEF("Colored alloc: %lu pages kept, %lu rejected.\n", n, nr_rejects);
+
+	list_for_each_entry_safe(page, t, &rejects, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	if (ret) {
+		while (n)
+			__free_page(pages[--n]);
+	}
+	return ret;
+}
+
+static void colored_free(struct page **pages, ulong count)
+{
+	ulong i;
+	for (i = 0; i < count; i++) {
+		__free_page(pages[i]);
+		if (!(i % CHAPTER_PAGES))
+			cond_resched();
+	}
+}
+
+/*
+* Imported buffers: user memory (typically hugetlbfs pages reserved at
+* boot) pinned for as long as the buffer lives. FOLL_LONGTERM keeps the
+* pages out of CMA and ZONE_MOVABLE, so they stay where we report them.
+* Like other long-term pins they count against the caller's
+* RLIMIT_MEMLOCK; the caller's mm is held until the buffer is freed,
+* possibly by the free worker, so the charge goes back to it.
+*/
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0))
+static int pin_user_range(ulong addr, struct page **pages, ulong count)
+{
+	ulong n = 0;
+	int ret;
+
+	ret = account_locked_vm(current->mm, count, true);
+	if (ret)
+		return ret;
+	while (n < count) {
+		ret = pin_user_pages_fast(addr + (n << PAGE_SHIFT),
+				min_t(ulong, count - n, CHAPTER_PAGES),
+				FOLL_WRITE | FOLL_LONGTERM, pages + n);
+		if (ret <= 0) {
+			unpin_user_pages(pages, n);
+			account_locked_vm(current->mm, count, false);
+			return ret ? ret : -EFAULT;
+		}
+		n += ret;
+		cond_resched();
+	}
+	mmgrab(current->mm);
+	return 0;
+}
+
+/* Undo pin_user_range() for the pages pinned into mm. */
+static void unpin_user_range(struct mm_struct *mm, struct page **pages,
+			ulong count)
+{
+	/* a device may have written to them behind the kernel's back */
+	unpin_user_pages_dirty_lock(pages, count, true);
+	account_locked_vm(mm, count, false);
+	mmdrop(mm);
+}
+#else
+static int pin_user_range(ulong addr, struct page **pages, ulong count)
+{
+	return -EOPNOTSUPP;
+}
+
+static void unpin_user_range(struct mm_struct *mm, struct page **pages,
+			ulong count)
+{
+}
+#endif
+
+struct import_run {
+	ulong pfn;
+	ulong count;
+};
+
+static int import_run_cmp(const void *a, const void *b)
+{
+	const struct import_run *x = a, *y = b;
+
+	return x->pfn < y->pfn ? -1 : x->pfn > y->pfn;
+}
+
+/*
+* Count the physical runs of an imported page list and find the longest.
+* Pages that follow each other both virtually and physically make one
+* entry, so a range of huge pages costs one entry per huge page; the
+* entries are then sorted by pfn and merged where they touch or overlap
+* (a page may be mapped more than once), in O(n log n) rather than the
+* O(n^2) of inserting them one by one into a cluster list.
+*/
+static int import_runs(struct page **pages, ulong count, ulong *nr_runs,
+			ulong *largest)
+{
+	struct import_run *runs;
+	ulong i, n = 0, start = 0, end;
+
+	runs = vmalloc(count * sizeof(*runs));
+	if (!runs)
+		return -ENOMEM;
+	for (i = 1; i <= count; i++) {
+		if (i < count &&
+		    page_to_pfn(pages[i]) == page_to_pfn(pages[i - 1]) + 1)
+			continue;
+		runs[n].pfn = page_to_pfn(pages[start]);
+		runs[n].count = i - start;
+		n++;
+		start = i;
+		cond_resched();
+	}
+	sort(runs, n, sizeof(*runs), import_run_cmp, NULL);
+
+	*nr_runs = *largest = 0;
+	for (i = 0; i < n; i = start) {
+		end = runs[i].pfn + runs[i].count;
+		for (start = i + 1; start < n && runs[start].pfn <= end; start++)
+			end = max(end, runs[start].pfn + runs[start].count);
+		(*nr_runs)++;
+		*largest = max(*largest, end - runs[i].pfn);
+		cond_resched();
+	}
+	vfree(runs);
+	return 0;
+}
+
+/*
+* A buffer handed out by the driver. Published buffers and each mapping
+* of one hold a reference; the memory goes back to the buddy allocator
+* when the last reference is dropped, so RELEASE can't pull pages out
+* from under an mmap in progress or a live mapping.
+*/
+struct bigcpm_buf {
+  struct kref    ref;
+  struct rcu_head rcu;
+  unsigned int   handle;
+  u64            size;
   phys_addr_t    paddr;
   struct page    *huge_block;
-} bigcpmdev_info_t;
+  bool           gigantic;	/* huge_block made of 1 GB chunks */
+  u64            align;		/* requested physical alignment, 0 if none */
+  struct page    **pages;	/* colored or imported buffer: one entry per page */
+  unsigned long  nr_pages;
+  bool           imported;	/* pages pinned from a user range, not ours */
+  struct mm_struct *mm;		/* imported: charged for the pinned pages */
+  struct list_head free_node;	/* on bigcpm_free_list once released */
+};
 
-/*local */
-static struct bigcpmdev_info bigcpm_info;
+/*
+* Buffer table. Lookups (GET_PHYSADDR, mmap) only take rcu_read_lock.
+* A slot is claimed by setting its bit in bigcpm_busy before harvesting,
+* so allocations of different buffers run in parallel and no lock is held
+* across the harvest loop. bigcpm_lock serializes publishing and
+* unpublishing, which also write the buffer's metadata page entry.
+*/
+static struct bigcpm_buf __rcu *bigcpm_bufs[BIGCPM_MAX_BUFS];
+static DECLARE_BITMAP(bigcpm_busy, BIGCPM_MAX_BUFS);
+static DEFINE_SPINLOCK(bigcpm_lock);
+
+/*
+* Read-only copy of the table for userspace, see bigcpm_meta_t. Writers
+* hold bigcpm_lock; readers never lock and instead follow the seqlock
+* protocol on meta->seq. The counter lives in the shared page itself,
+* so it is driven by hand rather than through a seqcount_t.
+*/
+static bigcpm_meta_t *bigcpm_meta;
+
+/* Default time budget for BIGCPM_ALLOC_COMPACT without a timeout. */
+static uint compact_timeout_ms = 2000;
+module_param(compact_timeout_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(compact_timeout_ms, "Default compaction retry budget [ms]");
+
+/* Counters reported by BIGCPM_GET_STATS. */
+static struct {
+	atomic64_t allocs;
+	atomic64_t alloc_failures;
+	atomic64_t compact_allocs;
+	atomic64_t compact_helped;
+	atomic64_t compact_retries;
+	atomic64_t range_rejects;
+	atomic64_t free_pending;
+} bigcpm_stats;
+
+/*
+* Buffers whose last reference is gone wait on bigcpm_free_list for the
+* free worker, so neither RELEASE nor the munmap or exit that drops the
+* last mapping waits for the memory to go back to the buddy allocator.
+*/
+static LIST_HEAD(bigcpm_free_list);
+static DEFINE_SPINLOCK(bigcpm_free_lock);
+
+static void bigcpm_free_worker(struct work_struct *work);
+static DECLARE_WORK(bigcpm_free_work, bigcpm_free_worker);
 
 static int bigcpm_open(struct inode *i, struct file *f)
 {
@@ -276,21 +1032,670 @@ static int bigcpm_close(struct inode *i, struct file *f)
     return 0;
 }
 
-static int alloc_bigcpm_dev (int size)
+static int alloc_bigcpm_dev(struct bigcpm_buf *buf, u64 size, bool gigantic,
+			struct alloc_policy *policy)
 {
-	bigcpm_info.huge_block = bigbuf_alloc(GFP_KERNEL | __GFP_HIGHMEM, size);
-	if (bigcpm_info.huge_block) 
+	u64 align = (u64) policy->align_pages << PAGE_SHIFT;
+
+	/* small buffers get their alignment by growing to it */
+	if (!gigantic && size <= CHAPTER_SIZE && align > size)
+		size = min_t(u64, align, CHAPTER_SIZE);
+
+	buf->huge_block = bigbuf_alloc_compact(policy_gfp(policy), size,
+					gigantic, policy);
+	if (buf->huge_block)
 	{
-		printk(KERN_INFO "Allocated block at 0x%lx.\n", (ulong) page_to_phys(bigcpm_info.huge_block));
+		printk(KERN_INFO "Allocated block at 0x%llx.\n",
+			(unsigned long long) page_to_phys(buf->huge_block));
 
-		bigcpm_info.paddr=page_to_phys(bigcpm_info.huge_block);
+		buf->paddr=page_to_phys(buf->huge_block);
+		buf->size=size;
+		buf->gigantic=gigantic;
+		buf->align=align;
 	}else {
-		printk(KERN_ERR "Allocation of size %u failed.\n", size);
-		return -1;
+		printk(KERN_ERR "Allocation of size %llu failed.\n",
+			(unsigned long long) size);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int alloc_bigcpm_colored(struct bigcpm_buf *buf,
+			u64 size, unsigned long color_mask, struct alloc_policy *policy)
+{
+	unsigned long nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	int ret;
+
+	buf->pages = vmalloc(nr_pages * sizeof(struct page *));
+	if (!buf->pages)
+		return -ENOMEM;
+	ret = colored_alloc(policy_gfp(policy), buf->pages,
+			nr_pages, color_mask, policy);
+	if (ret) {
+		printk(KERN_ERR "Colored allocation of size %llu (mask 0x%lx) failed.\n",
+			(unsigned long long) size, color_mask);
+		vfree(buf->pages);
+		buf->pages = NULL;
+		return ret;
+	}
+	printk(KERN_INFO "Allocated %lu colored pages (mask 0x%lx).\n",
+		nr_pages, color_mask);
+	buf->nr_pages = nr_pages;
+	buf->size = (u64) nr_pages << PAGE_SHIFT;
+	buf->paddr = 0;
+	return 0;
+}
+
+static void free_bigcpm_dev(struct bigcpm_buf *buf)
+{
+	if (buf->imported) {
+		printk(KERN_INFO "Unpinning %lu imported pages.\n", buf->nr_pages);
+		unpin_user_range(buf->mm, buf->pages, buf->nr_pages);
+		vfree(buf->pages);
+	} else if (buf->pages) {
+		printk(KERN_INFO "Freeing %lu colored pages.\n", buf->nr_pages);
+		colored_free(buf->pages, buf->nr_pages);
+		vfree(buf->pages);
+	} else if (buf->huge_block) {
+		printk(KERN_INFO "Freeing block at 0x%llx.\n",
+			(unsigned long long) page_to_phys(buf->huge_block));
+		if (buf->gigantic)
+			bigbuf_free_gigantic(buf->huge_block, buf->size);
+		else
+			bigbuf_free(buf->huge_block, buf->size);
+	}
+}
+
+/* Mirror slot handle into the metadata page; buf NULL clears it. */
+static void bigcpm_meta_update(unsigned int handle, struct bigcpm_buf *buf)
+{
+	bigcpm_meta_entry_t *e = &bigcpm_meta->bufs[handle];
+
+	lockdep_assert_held(&bigcpm_lock);
+	WRITE_ONCE(bigcpm_meta->seq, bigcpm_meta->seq + 1);
+	smp_wmb();
+	if (buf) {
+		e->paddr = buf->paddr;
+		e->size = buf->size;
+		e->node = page_to_nid(buf->pages ? buf->pages[0] : buf->huge_block);
+		e->flags = (buf->imported ? BIGCPM_META_IMPORTED :
+			    buf->pages ? BIGCPM_META_COLORED : 0) |
+			(buf->gigantic ? BIGCPM_META_GIGANTIC : 0);
+	} else {
+		e->paddr = 0;
+		e->size = 0;
+		e->node = -1;
+		e->flags = 0;
+	}
+	e->generation++;
+	bigcpm_meta->generation++;
+	smp_wmb();
+	WRITE_ONCE(bigcpm_meta->seq, bigcpm_meta->seq + 1);
+}
+
+static void bigcpm_free_worker(struct work_struct *work)
+{
+	struct bigcpm_buf *buf, *t;
+	LIST_HEAD(batch);
+
+	spin_lock(&bigcpm_free_lock);
+	list_splice_init(&bigcpm_free_list, &batch);
+	spin_unlock(&bigcpm_free_lock);
+
+	list_for_each_entry_safe(buf, t, &batch, free_node) {
+		free_bigcpm_dev(buf);
+		atomic64_sub(buf->size, &bigcpm_stats.free_pending);
+		kfree_rcu(buf, rcu);
+		cond_resched();
+	}
+}
+
+/* Last reference gone: give back the slot now, the memory later. Nothing
+maps the buffer any more, as every mapping holds a reference. */
+static void bigcpm_buf_release(struct kref *ref)
+{
+	struct bigcpm_buf *buf = container_of(ref, struct bigcpm_buf, ref);
+
+	clear_bit(buf->handle, bigcpm_busy);
+	atomic64_add(buf->size, &bigcpm_stats.free_pending);
+	spin_lock(&bigcpm_free_lock);
+	list_add_tail(&buf->free_node, &bigcpm_free_list);
+	spin_unlock(&bigcpm_free_lock);
+	queue_work(system_unbound_wq, &bigcpm_free_work);
+}
+
+/* Take a reference on a published buffer, NULL if there is none. */
+static struct bigcpm_buf *bigcpm_buf_get(unsigned long handle)
+{
+	struct bigcpm_buf *buf;
+
+	if (handle >= BIGCPM_MAX_BUFS)
+		return NULL;
+	rcu_read_lock();
+	buf = rcu_dereference(bigcpm_bufs[handle]);
+	if (buf && !kref_get_unless_zero(&buf->ref))
+		buf = NULL;
+	rcu_read_unlock();
+	return buf;
+}
+
+static void bigcpm_buf_put(struct bigcpm_buf *buf)
+{
+	kref_put(&buf->ref, bigcpm_buf_release);
+}
+
+static int alloc_bigcpm_buf(struct bigcpm_buf *buf, bigcpm_alloc_arg_t *a,
+			struct alloc_policy *policy)
+{
+	if (a->flags & BIGCPM_ALLOC_COLORED)
+		return alloc_bigcpm_colored(buf, a->size, a->color_mask, policy);
+	return alloc_bigcpm_dev(buf, a->size,
+			a->flags & BIGCPM_ALLOC_GIGANTIC, policy);
+}
+
+/* Claim slot handle, or the lowest free slot if handle is negative.
+Slot 0 belongs to the legacy calls and is only claimed by name.
+Returns the handle or -errno. */
+static int bigcpm_slot_claim(int handle)
+{
+	if (handle < 0) {
+		for (handle = 1; handle < BIGCPM_MAX_BUFS; handle++) {
+			if (!test_and_set_bit(handle, bigcpm_busy))
+				break;
+		}
+		if (handle == BIGCPM_MAX_BUFS)
+			return -ENOSPC;
+	} else if (test_and_set_bit(handle, bigcpm_busy)) {
+		return -EBUSY;
+	}
+	return handle;
+}
+
+/* Make a fully set up buffer visible to lookups and the metadata page. */
+static void bigcpm_buf_publish(struct bigcpm_buf *buf)
+{
+	spin_lock(&bigcpm_lock);
+	rcu_assign_pointer(bigcpm_bufs[buf->handle], buf);
+	bigcpm_meta_update(buf->handle, buf);
+	spin_unlock(&bigcpm_lock);
+}
+
+/* Allocate a buffer into slot handle, or the lowest free slot if handle
+is negative. Returns the handle or -errno. */
+static int bigcpm_buf_create(int handle, bigcpm_alloc_arg_t *a)
+{
+	struct bigcpm_buf *buf;
+	struct alloc_policy policy = { .pfn_max = ~0UL };
+	int ret;
+
+	handle = bigcpm_slot_claim(handle);
+	if (handle < 0)
+		return handle;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	kref_init(&buf->ref);
+	buf->handle = handle;
+
+	if (a->flags & BIGCPM_ALLOC_COMPACT) {
+		policy.compact = true;
+		policy.deadline = jiffies + msecs_to_jiffies(a->timeout_ms ?
+				a->timeout_ms : compact_timeout_ms);
+		atomic64_inc(&bigcpm_stats.compact_allocs);
+	}
+	if (a->align > PAGE_SIZE)
+		policy.align_pages = a->align >> PAGE_SHIFT;
+	policy_set_window(&policy, a->phys_min, a->phys_max);
+
+	ret = alloc_bigcpm_buf(buf, a, &policy);
+	/* memory still on its way back may be just what we need */
+	if (ret == -ENOMEM && atomic64_read(&bigcpm_stats.free_pending) &&
+	    flush_work(&bigcpm_free_work))
+		ret = alloc_bigcpm_buf(buf, a, &policy);
+
+	atomic64_add(policy.compacted, &bigcpm_stats.compact_retries);
+	atomic64_add(policy.rejected, &bigcpm_stats.range_rejects);
+	if (ret) {
+		atomic64_inc(&bigcpm_stats.alloc_failures);
+		kfree(buf);
+		goto fail;
+	}
+	atomic64_inc(&bigcpm_stats.allocs);
+	if (policy.compacted)
+		atomic64_inc(&bigcpm_stats.compact_helped);
+
+	a->handle = handle;
+	a->paddr = buf->paddr;
+	a->size = buf->size;
+	bigcpm_buf_publish(buf);
+	return handle;
+fail:
+	clear_bit(handle, bigcpm_busy);
+	return ret;
+}
+
+/* BIGCPM_IMPORT: pin a user range and publish it as a buffer in the
+lowest free slot. */
+static int bigcpm_import(bigcpm_import_arg_t *im)
+{
+	struct bigcpm_buf *buf;
+	ulong nr_pages, nr_runs, largest, i;
+	int handle, ret;
+
+	if (!im->size || (im->addr | im->size) & ~PAGE_MASK ||
+	    im->size >= BIGCPM_MMAP_OFFSET(1))
+		return -EINVAL;
+	if (im->addr > ULONG_MAX - im->size)
+		return -EFAULT;
+	nr_pages = im->size >> PAGE_SHIFT;
+
+	handle = bigcpm_slot_claim(-1);
+	if (handle < 0)
+		return handle;
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	kref_init(&buf->ref);
+	buf->handle = handle;
+	buf->pages = vmalloc(nr_pages * sizeof(struct page *));
+	if (!buf->pages) {
+		ret = -ENOMEM;
+		goto fail_buf;
+	}
+	ret = pin_user_range(im->addr, buf->pages, nr_pages);
+	if (ret)
+		goto fail_pages;
+	buf->mm = current->mm;
+	ret = import_runs(buf->pages, nr_pages, &nr_runs, &largest);
+	if (ret) {
+		unpin_user_range(buf->mm, buf->pages, nr_pages);
+		goto fail_pages;
+	}
+
+	buf->imported = true;
+	buf->nr_pages = nr_pages;
+	buf->size = im->size;
+	/* one physical run is not enough, it has to be in virtual order */
+	for (i = 1; i < nr_pages; i++)
+		if (page_to_pfn(buf->pages[i]) != page_to_pfn(buf->pages[0]) + i)
+			break;
+	if (i == nr_pages)
+		buf->paddr = page_to_phys(buf->pages[0]);
+	printk(KERN_INFO "Imported %lu pages in %lu runs%s.\n", nr_pages,
+		nr_runs, buf->paddr ? ", contiguous" : "");
+
+	im->handle = handle;
+	im->paddr = buf->paddr;
+	im->nr_runs = nr_runs;
+	im->largest_run = (u64) largest << PAGE_SHIFT;
+	bigcpm_buf_publish(buf);
+	return 0;
+fail_pages:
+	vfree(buf->pages);
+fail_buf:
+	kfree(buf);
+fail:
+	clear_bit(handle, bigcpm_busy);
+	return ret;
+}
+
+/* Unpublish a buffer and drop the table's reference to it. */
+static int bigcpm_buf_destroy(unsigned long handle)
+{
+	struct bigcpm_buf *buf;
+
+	if (handle >= BIGCPM_MAX_BUFS)
+		return -EINVAL;
+	spin_lock(&bigcpm_lock);
+	buf = rcu_dereference_protected(bigcpm_bufs[handle],
+			lockdep_is_held(&bigcpm_lock));
+	RCU_INIT_POINTER(bigcpm_bufs[handle], NULL);
+	if (buf)
+		bigcpm_meta_update(handle, NULL);
+	spin_unlock(&bigcpm_lock);
+
+	if (!buf)
+		return -ENOENT;
+	bigcpm_buf_put(buf);
+	return 0;
+}
+
+/* Lock-free lookup of a buffer's address and size. */
+static int bigcpm_buf_query(unsigned long handle, u64 *paddr, u64 *size)
+{
+	struct bigcpm_buf *buf;
+
+	if (handle >= BIGCPM_MAX_BUFS)
+		return -EINVAL;
+	rcu_read_lock();
+	buf = rcu_dereference(bigcpm_bufs[handle]);
+	if (buf) {
+		*paddr = buf->paddr;
+		*size = buf->size;
+	}
+	rcu_read_unlock();
+	return buf ? 0 : -ENOENT;
+}
+
+/* Copy the physical address of every page of the buffer to the user
+array sg->paddrs. */
+static int get_bigcpm_sglist(bigcpm_sg_arg_t *sg)
+{
+	struct bigcpm_buf *buf;
+	unsigned long i, nr_pages;
+	u64 __user *paddrs;
+	u64 pa;
+	int ret = 0;
+
+	buf = bigcpm_buf_get(sg->handle);
+	if (!buf)
+		return -ENOENT;
+	paddrs = (u64 __user *)(uintptr_t) sg->paddrs;
+	nr_pages = buf->pages ? buf->nr_pages :
+			PAGE_ALIGN(buf->size) >> PAGE_SHIFT;
+	for (i = 0; i < nr_pages && i < sg->nents; i++) {
+		if (buf->pages)
+			pa = page_to_phys(buf->pages[i]);
+		else
+			pa = buf->paddr + ((u64)i << PAGE_SHIFT);
+		if (put_user(pa, &paddrs[i])) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+	sg->nents = nr_pages;
+out:
+	bigcpm_buf_put(buf);
+	return ret;
+}
+
+static void get_bigcpm_stats(bigcpm_stats_t *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->allocs = atomic64_read(&bigcpm_stats.allocs);
+	st->alloc_failures = atomic64_read(&bigcpm_stats.alloc_failures);
+	st->compact_allocs = atomic64_read(&bigcpm_stats.compact_allocs);
+	st->compact_helped = atomic64_read(&bigcpm_stats.compact_helped);
+	st->compact_retries = atomic64_read(&bigcpm_stats.compact_retries);
+	st->range_rejects = atomic64_read(&bigcpm_stats.range_rejects);
+	st->free_pending = atomic64_read(&bigcpm_stats.free_pending);
+}
+
+/* Checks shared by BIGCPM_ALLOC_EX and BIGCPM_QUERY, so both reject
+alike. Returns 0 or -errno. */
+static int alloc_args_check(u64 flags, u64 size, u64 align, u64 phys_min,
+			u64 phys_max)
+{
+	if (flags & ~(BIGCPM_ALLOC_COLORED | BIGCPM_ALLOC_GIGANTIC |
+		      BIGCPM_ALLOC_COMPACT) ||
+	    !size_ok(size) ||
+	    (align & (align - 1)) || align >= BIGCPM_MMAP_OFFSET(1) ||
+	    (flags & BIGCPM_ALLOC_COLORED && align > PAGE_SIZE) ||
+	    !window_ok(size, phys_min, phys_max) ||
+	    (flags & BIGCPM_ALLOC_COLORED &&
+	     flags & (BIGCPM_ALLOC_GIGANTIC | BIGCPM_ALLOC_COMPACT)))
+		return -EINVAL;
+#ifndef HAVE_GIGANTIC
+	if (flags & BIGCPM_ALLOC_GIGANTIC)
+		return -EOPNOTSUPP;
+#endif
+	return 0;
+}
+
+/* BIGCPM_QUERY: how likely an allocation of the given shape is to succeed,
+per zone and overall. BIGCPM_ALLOC_COMPACT does not change the shape and
+is ignored; the verdict already tells whether compaction would help. */
+static int bigcpm_query(bigcpm_query_arg_t __user *uarg)
+{
+	struct alloc_policy policy = { .pfn_max = ~0UL };
+	bigcpm_zone_info_t __user *zones;
+	bigcpm_query_arg_t q;
+	bigcpm_zone_info_t zi;
+	ulong pages, align_pages, free_chunks, largest_run;
+	unsigned int order = 0, highest;
+	bool small = false, fits;
+	u64 n = 0;
+	int nid, z, ret;
+
+	if (copy_from_user(&q, uarg, sizeof(q)))
+		return -EFAULT;
+	ret = alloc_args_check(q.flags, q.size, q.align, q.phys_min,
+			q.phys_max);
+	if (ret)
+		return ret;
+	policy_set_window(&policy, q.phys_min, q.phys_max);
+	highest = gfp_zone(policy_gfp(&policy));
+
+	/* the shapes alloc_bigcpm_dev() and bigbuf_alloc*() would ask for */
+	align_pages = q.align > PAGE_SIZE ? q.align >> PAGE_SHIFT : 1;
+	if (q.flags & BIGCPM_ALLOC_COLORED) {
+		/* single pages; whether enough have the right colors is
+		beyond what the free counts can tell */
+		small = true;
+		pages = 1;
+	} else if (q.flags & BIGCPM_ALLOC_GIGANTIC) {
+		pages = chunk_round_pages(q.size, GIGANTIC_ORDER);
+		align_pages = max(align_pages, GIGANTIC_PAGES);
+	} else if (q.size <= CHAPTER_SIZE && align_pages <= CHAPTER_PAGES) {
+		small = true;
+		order = get_order(max_t(u64, q.size,
+				(u64) align_pages << PAGE_SHIFT));
+		pages = 1UL << order;
+	} else {
+		pages = chunk_round_pages(q.size, CHAPTER_ORDER);
+		align_pages = max_t(ulong, align_pages, CHAPTER_PAGES);
+	}
+
+	zones = (bigcpm_zone_info_t __user *)(uintptr_t) q.zones;
+	q.verdict = BIGCPM_QUERY_NO;
+	q.largest_run = 0;
+	for_each_online_node(nid) {
+		if (q.node >= 0 && nid != q.node)
+			continue;
+		for (z = 0; z < MAX_NR_ZONES; z++) {
+			struct zone *zone = &NODE_DATA(nid)->node_zones[z];
+
+			if (!populated_zone(zone))
+				continue;
+			fits = scan_zone(zone, pages, align_pages, &policy,
+					&free_chunks, &largest_run);
+			if (small)
+				fits = zone_in_window(zone, &policy) &&
+					zone_has_order(zone, order);
+
+			memset(&zi, 0, sizeof(zi));
+			zi.node = nid;
+			zi.zone = z;
+			strscpy(zi.name, zone->name, sizeof(zi.name));
+			zi.free_pages = zone_page_state(zone, NR_FREE_PAGES);
+			zi.movable_pages = zone_movable_pages(zone);
+			zi.free_chunks = free_chunks;
+			zi.largest_run = (u64) largest_run << PAGE_SHIFT;
+			if (fits)
+				zi.verdict = BIGCPM_QUERY_NOW;
+			else if (zone_in_window(zone, &policy) &&
+				 zone->spanned_pages >= pages &&
+				 zi.free_pages + zi.movable_pages >= pages)
+				zi.verdict = BIGCPM_QUERY_COMPACT;
+			else
+				zi.verdict = BIGCPM_QUERY_NO;
+
+			/* only zones our GFP flags reach count for the answer */
+			if (z <= highest) {
+				q.verdict = max(q.verdict, zi.verdict);
+				q.largest_run = max(q.largest_run, zi.largest_run);
+			}
+			if (n < q.nzones &&
+			    copy_to_user(&zones[n], &zi, sizeof(zi)))
+				return -EFAULT;
+			n++;
+		}
+	}
+	q.nzones = n;
+	if (copy_to_user(uarg, &q, sizeof(q)))
+		return -EFAULT;
+	return 0;
+}
+
+/* BIGCPM_ALLOC_EX: check the request and allocate into a free slot. */
+static int bigcpm_alloc_ex(bigcpm_alloc_arg_t *a)
+{
+	int ret;
+
+	ret = alloc_args_check(a->flags, a->size, a->align, a->phys_min,
+			a->phys_max);
+	if (ret)
+		return ret;
+
+	ret = bigcpm_buf_create(-1, a);
+	return ret < 0 ? ret : 0;
+}
+
+/* One BIGCPM_BATCH operation, on a copy in kernel memory. */
+static int bigcpm_run_op(bigcpm_op_t *op)
+{
+	switch (op->op) {
+	case BIGCPM_OP_ALLOC:
+		return bigcpm_alloc_ex(&op->alloc);
+	case BIGCPM_OP_BUF_GET:
+		return bigcpm_buf_query(op->buf.handle, &op->buf.paddr,
+				&op->buf.size);
+	case BIGCPM_OP_BUF_RELEASE:
+		return bigcpm_buf_destroy(op->buf.handle);
+	case BIGCPM_OP_GET_SGLIST:
+		return get_bigcpm_sglist(&op->sg);
+	case BIGCPM_OP_IMPORT:
+		return bigcpm_import(&op->import);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Fill in op's handle from the earlier operation uops[op->ref], for
+BIGCPM_OP_REF_HANDLE; index is op's own position in the batch. */
+static int bigcpm_op_resolve(bigcpm_op_t __user *uops, u64 index,
+			bigcpm_op_t *op)
+{
+	bigcpm_op_t src;
+	u64 handle;
+
+	if (op->flags & ~BIGCPM_OP_REF_HANDLE)
+		return -EINVAL;
+	if (!op->flags)
+		return 0;
+	if (op->ref >= index)
+		return -EINVAL;
+	if (copy_from_user(&src, &uops[op->ref], sizeof(src)))
+		return -EFAULT;
+	switch (src.op) {
+	case BIGCPM_OP_ALLOC:
+		handle = src.alloc.handle;
+		break;
+	case BIGCPM_OP_IMPORT:
+		handle = src.import.handle;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (src.result)
+		return -ENOENT;
+
+	switch (op->op) {
+	case BIGCPM_OP_BUF_GET:
+	case BIGCPM_OP_BUF_RELEASE:
+		op->buf.handle = handle;
+		return 0;
+	case BIGCPM_OP_GET_SGLIST:
+		op->sg.handle = handle;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/* BIGCPM_BATCH: run the operations in order, writing each one back with
+its result. Only a fault on the arrays themselves or a fatal signal fails
+the call; failed operations are counted in failed. */
+static int bigcpm_batch(bigcpm_batch_arg_t __user *uarg)
+{
+	bigcpm_op_t __user *uops;
+	bigcpm_batch_arg_t b;
+	bigcpm_op_t op;
+	int ret = 0;
+
+	if (copy_from_user(&b, uarg, sizeof(b)))
+		return -EFAULT;
+	if (b.flags & ~BIGCPM_BATCH_CONTINUE)
+		return -EINVAL;
+	uops = (bigcpm_op_t __user *)(uintptr_t) b.ops;
+	b.done = b.failed = 0;
+	while (b.done < b.nops) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		if (copy_from_user(&op, &uops[b.done], sizeof(op))) {
+			ret = -EFAULT;
+			break;
+		}
+		op.result = bigcpm_op_resolve(uops, b.done, &op);
+		if (!op.result)
+			op.result = bigcpm_run_op(&op);
+		if (copy_to_user(&uops[b.done], &op, sizeof(op))) {
+			ret = -EFAULT;
+			break;
+		}
+		b.done++;
+		if (op.result) {
+			b.failed++;
+			if (!(b.flags & BIGCPM_BATCH_CONTINUE))
+				break;
+		}
+		cond_resched();
+	}
+	if (copy_to_user(uarg, &b, sizeof(b)))
+		return -EFAULT;
+	return ret;
+}
+
+/* BIGCPM_ALLOC: buffer 0, -EBUSY if it is already allocated. */
+static int bigcpm_legacy_alloc(u64 size)
+{
+	bigcpm_alloc_arg_t a;
+	int ret;
+
+	if (!size_ok(size))
+		return -EINVAL;
+	memset(&a, 0, sizeof(a));
+	a.size = size;
+	ret = bigcpm_buf_create(0, &a);
+	if (ret == -EBUSY)
+		return ret;
+	if (ret < 0)
+	{
+		printk("ERROR in alloc_bigcpm_dev()\n");
+		return -EINVAL;
 	}
 	return 0;
 }
 
+/* BIGCMP_GET_PHYSADDR: buffer 0, zeroes if there is none. limit is the
+largest value the caller's unsigned long can hold. */
+static int bigcpm_legacy_query(u64 *paddr, u64 *size, u64 limit)
+{
+	*paddr = *size = 0;
+	bigcpm_buf_query(0, paddr, size);
+	/* be carefull that phys_addr_t can be 64 bits */
+	TRACEF("BIGCMP_GET_PHYSADDR 0x%llx \n", (unsigned long long) *paddr);
+	if (*paddr > limit || *size > limit)
+		return -EOVERFLOW;
+	return 0;
+}
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
 static int bigcpm_ioctl(struct inode *i, struct file *f, unsigned int cmd, unsigned long arg)
@@ -299,32 +1704,32 @@ static long bigcpm_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 #endif
 {
     bigcpm_arg_t q;
- 
+    bigcpm_buf_arg_t b;
+    bigcpm_alloc_arg_t a;
+    bigcpm_sg_arg_t sg;
+    bigcpm_import_arg_t im;
+    bigcpm_stats_t st;
+    u64 paddr, size;
+    int ret;
+
+    /* the legacy BIGCPM_ALLOC/RELEASE/GET_PHYSADDR act on buffer 0 */
     switch (cmd)
     {
         case BIGCMP_GET_PHYSADDR:
-	    /* be carefull that phys_addr_t can be 64 bits */
-	    printk("BIGCMP_GET_PHYSADDR 0x%x \n", (unsigned long)bigcpm_info.paddr);
-	    q.paddr= bigcpm_info.paddr;
-	    q.size = bigcpm_info.size;
+	    ret = bigcpm_legacy_query(&paddr, &size, ULONG_MAX);
+	    if (ret)
+		return ret;
+	    q.paddr = paddr;
+	    q.size = size;
             if (copy_to_user((bigcpm_arg_t *)arg, &q, sizeof(bigcpm_arg_t)))
             {
 	    	printk("BIGCMP_GET_PHYSADDR failed \n");
                 return -EACCES;
             }
-	    
+
             break;
         case BIGCMP_RELEASE:
-   		if (bigcpm_info.huge_block) {
-			printk(KERN_INFO "Freeing block at 0x%lx.\n",
-					(ulong) page_to_phys(bigcpm_info.huge_block));
-#if 1			
-			if (allocated) {
-				bigbuf_free(bigcpm_info.huge_block, bigcpm_info.size);
-				allocated = 0;
-			}
-#endif
-		}
+		bigcpm_buf_destroy(0);
             break;
         case BIGCPM_ALLOC:
             if (copy_from_user(&q, (bigcpm_arg_t *)arg, sizeof(bigcpm_arg_t)))
@@ -333,100 +1738,255 @@ static long bigcpm_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
                 return -EACCES;
             }
 
-	    bigcpm_info.size=q.size;
-	    printk("BIGCPM_ALLOC:size 0x%x\n",q.size);
-#if 1
-	    if(!allocated) 
-	    {	
-	    	if (alloc_bigcpm_dev(q.size) != 0 )
-	    	{
-	    		printk("ERROR in alloc_bigcpm_dev()\n");
-			return -EINVAL;
-	    	}
-		allocated = 1;
-	    }
-#endif
+	    return bigcpm_legacy_alloc(q.size);
+        case BIGCPM_ALLOC_EX:
+            if (copy_from_user(&a, (bigcpm_alloc_arg_t *)arg, sizeof(a)))
+                return -EFAULT;
+	    ret = bigcpm_alloc_ex(&a);
+	    if (ret)
+		return ret;
+            if (copy_to_user((bigcpm_alloc_arg_t *)arg, &a, sizeof(a)))
+                return -EFAULT;
+            break;
+        case BIGCPM_BUF_GET:
+            if (copy_from_user(&b, (bigcpm_buf_arg_t *)arg, sizeof(b)))
+                return -EFAULT;
+	    ret = bigcpm_buf_query(b.handle, &b.paddr, &b.size);
+	    if (ret)
+		return ret;
+            if (copy_to_user((bigcpm_buf_arg_t *)arg, &b, sizeof(b)))
+                return -EFAULT;
+            break;
+        case BIGCPM_BUF_RELEASE:
+            if (copy_from_user(&b, (bigcpm_buf_arg_t *)arg, sizeof(b)))
+                return -EFAULT;
+	    return bigcpm_buf_destroy(b.handle);
+        case BIGCPM_GET_SGLIST:
+            if (copy_from_user(&sg, (bigcpm_sg_arg_t *)arg, sizeof(sg)))
+                return -EFAULT;
+	    ret = get_bigcpm_sglist(&sg);
+	    if (ret)
+		return ret;
+            if (copy_to_user((bigcpm_sg_arg_t *)arg, &sg, sizeof(sg)))
+                return -EFAULT;
+            break;
+        case BIGCPM_QUERY:
+	    return bigcpm_query((bigcpm_query_arg_t __user *)arg);
+        case BIGCPM_BATCH:
+	    return bigcpm_batch((bigcpm_batch_arg_t __user *)arg);
+        case BIGCPM_IMPORT:
+            if (copy_from_user(&im, (bigcpm_import_arg_t *)arg, sizeof(im)))
+                return -EFAULT;
+	    ret = bigcpm_import(&im);
+	    if (ret)
+		return ret;
+            if (copy_to_user((bigcpm_import_arg_t *)arg, &im, sizeof(im)))
+                return -EFAULT;
+            break;
+        case BIGCPM_GET_STATS:
+	    get_bigcpm_stats(&st);
+            if (copy_to_user((bigcpm_stats_t *)arg, &st, sizeof(st)))
+                return -EFAULT;
             break;
         default:
             return -EINVAL;
     }
- 
+
     return 0;
 }
 
+#if defined(CONFIG_COMPAT) && (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35))
 /*
-  * Common VMA ops.
+* The BIGCPM_BUF_* and BIGCPM_ALLOC_EX structures are fixed width and
+* pass straight through. Only the legacy calls, whose structure and
+* command numbers are built from unsigned long, need translating.
+*/
+typedef struct
+{
+    compat_ulong_t paddr;
+    compat_ulong_t size;
+} bigcpm_arg32_t;
+
+#define  BIGCPM_ALLOC32		_IOW('b', 1, compat_ulong_t)
+#define  BIGCMP_GET_PHYSADDR32	_IOR('b', 3, compat_ulong_t)
+
+static long bigcpm_compat_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+    bigcpm_arg32_t q;
+    u64 paddr, size;
+    int ret;
+
+    switch (cmd)
+    {
+        case BIGCPM_ALLOC32:
+            if (copy_from_user(&q, compat_ptr(arg), sizeof(q)))
+                return -EFAULT;
+	    return bigcpm_legacy_alloc(q.size);
+        case BIGCMP_GET_PHYSADDR32:
+	    ret = bigcpm_legacy_query(&paddr, &size, 0xffffffffULL);
+	    if (ret)
+		return ret;
+	    q.paddr = paddr;
+	    q.size = size;
+            if (copy_to_user(compat_ptr(arg), &q, sizeof(q)))
+                return -EFAULT;
+	    return 0;
+        default:
+	    return bigcpm_ioctl(f, cmd, (unsigned long) compat_ptr(arg));
+    }
+}
+#endif
+
+/*
+  * Common VMA ops. Every VMA, including copies made by fork or a split,
+  * holds a reference to the buffer it maps.
   */
- 
-void bigcpm_vma_open(struct vm_area_struct *vma)
+
+static void bigcpm_vma_open(struct vm_area_struct *vma)
  {
-         printk(KERN_NOTICE "bigcpm VMA open, virt %lx, phys %lx\n",
-                         vma->vm_start, vma->vm_pgoff << PAGE_SHIFT);
+	struct bigcpm_buf *buf = vma->vm_private_data;
+
+	TRACEF("bigcpm VMA open, virt %lx, buffer %u\n",
+		vma->vm_start, buf->handle);
+	kref_get(&buf->ref);
  }
- 
- void bigcpm_vma_close(struct vm_area_struct *vma)
+
+static void bigcpm_vma_close(struct vm_area_struct *vma)
  {
-         printk(KERN_NOTICE "bigcpm VMA close.\n");
+	struct bigcpm_buf *buf = vma->vm_private_data;
+
+	TRACEF("bigcpm VMA close, buffer %u\n", buf->handle);
+	bigcpm_buf_put(buf);
  }
- 
+
 
 /*
   * The remap_pfn_range version of mmap.  This one is heavily borrowed
   * from drivers/char/mem.c.
   */
- 
+
 static struct vm_operations_struct bigcpm_remap_vm_ops = {
          .open =  bigcpm_vma_open,
          .close = bigcpm_vma_close,
 };
 
+/* The metadata page: one page, read-only for good (no mprotect to
+writable later). */
+static int bigcpm_mmap_meta(struct vm_area_struct *vma, unsigned long pgoff,
+			size_t size)
+{
+	if (pgoff || size != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0))
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(bigcpm_meta) >> PAGE_SHIFT,
+			PAGE_SIZE, vma->vm_page_prot);
+}
+
+/* Map the buffer selected by the high bits of the offset, see
+BIGCPM_MMAP_HANDLE_SHIFT. */
 static int bigcpm_mmap(struct file *file, struct vm_area_struct *vma)
 {
   	size_t size = vma->vm_end - vma->vm_start;
-	if (!(vma->vm_flags & VM_SHARED)) 
+	unsigned long handle = vma->vm_pgoff >> (BIGCPM_MMAP_HANDLE_SHIFT - PAGE_SHIFT);
+	unsigned long pgoff = vma->vm_pgoff &
+			((1UL << (BIGCPM_MMAP_HANDLE_SHIFT - PAGE_SHIFT)) - 1);
+	struct bigcpm_buf *buf;
+	int ret = 0;
+
+	if (!(vma->vm_flags & VM_SHARED))
 	{
 	   	pr_err("Mapping must be shared. Use MAP_SHARED flag in mmap! \n");
     		return -EINVAL;
   	}
-	if ( ((vma->vm_pgoff << PAGE_SHIFT) + size ) > bigcpm_info.size) 
+	if (handle == BIGCPM_META_HANDLE)
+		return bigcpm_mmap_meta(vma, pgoff, size);
+	buf = bigcpm_buf_get(handle);
+	if (!buf)
+	{
+		pr_err("%s: no buffer %lu\n", __func__, handle);
+		return -ENXIO;
+	}
+	if ( (((u64)pgoff << PAGE_SHIFT) + size ) > buf->size)
 	{
-    		pr_err ("%s: Attempting to Map more than MAX pgoff=%x, size=%x, bigcpm_size=%x\n",
+    		pr_err ("%s: Attempting to Map more than MAX pgoff=%lx, size=%zx, bigcpm_size=%llx\n",
       		__func__,
-		(u32)vma->vm_pgoff, size, bigcpm_info.size);
-    		return -EINVAL;
+		pgoff, size, (unsigned long long) buf->size);
+    		ret = -EINVAL;
+		goto out;
   	}
-#if 0
-        if (vma->vm_pgoff) {
-                pr_err("%s: non-zero mmap page-offset 0x%lx is invalid\n",
-                        __func__, vma->vm_pgoff);
-                return -EINVAL;
-        }
-        if (size != bigcpm_info.size) {
-                pr_err("%s: mmap size 0x%llx doesn't match region (0x%llx)\n",
-                        __func__, (unsigned long long)size, bigcpm_info.size);
-                return -EINVAL;
-        }
-        if (vma->vm_start & (bigcpm_info.size - 1)) {
-                pr_err("%s: un-aligned mapping %llx:%llx -> %lx\n",
-                        __func__, bigcpm_info.paddr, bigcpm_info.size,
-                        vma->vm_start);
-                return -EINVAL;
-        }
-	vma->vm_ops = &bigcpm_remap_vm_ops;
-	bigcpm_vma_open(vma);
-#endif
-	TRACEF("vma->vm_pgoff 0x%x, size 0x%x\n",vma->vm_pgoff, size);
+	TRACEF("vma->vm_pgoff 0x%lx, size 0x%zx\n",vma->vm_pgoff, size);
 
-        if (remap_pfn_range(vma, 
-			vma->vm_start, 
-			(bigcpm_info.paddr+(vma->vm_pgoff<<PAGE_SHIFT))>> PAGE_SHIFT,
+	if (buf->pages) {
+		/* colored buffer: not contiguous, map page by page */
+		unsigned long i, addr = vma->vm_start;
+		for (i = pgoff; addr < vma->vm_end; i++, addr += PAGE_SIZE) {
+			if (remap_pfn_range(vma, addr,
+					page_to_pfn(buf->pages[i]),
+					PAGE_SIZE, vma->vm_page_prot)) {
+				ret = -EAGAIN;
+				goto out;
+			}
+		}
+	} else if (remap_pfn_range(vma,
+			vma->vm_start,
+			(buf->paddr+((u64)pgoff<<PAGE_SHIFT))>> PAGE_SHIFT,
 			size,
                         vma->vm_page_prot)
 		)
 	{
-                return -EAGAIN;
+                ret = -EAGAIN;
+		goto out;
+	}
+
+	/* the mapping keeps the reference taken above */
+	vma->vm_private_data = buf;
+	vma->vm_ops = &bigcpm_remap_vm_ops;
+	return 0;
+out:
+	bigcpm_buf_put(buf);
+	return ret;
+}
+
+/* Place mappings of an aligned buffer so that virtual and physical
+addresses agree modulo the alignment, so an address in the mapping is
+as aligned as the memory behind it. The mapping itself is still made
+of base pages by remap_pfn_range; this does not get it larger
+translation entries. */
+static unsigned long bigcpm_get_unmapped_area(struct file *file,
+		unsigned long addr, unsigned long len, unsigned long pgoff,
+		unsigned long flags)
+{
+	unsigned long handle = pgoff >> (BIGCPM_MMAP_HANDLE_SHIFT - PAGE_SHIFT);
+	u64 off = (u64) (pgoff &
+		((1UL << (BIGCPM_MMAP_HANDLE_SHIFT - PAGE_SHIFT)) - 1)) << PAGE_SHIFT;
+	struct bigcpm_buf *buf;
+	unsigned long align = 0;
+	unsigned long area;
+
+	buf = bigcpm_buf_get(handle);
+	if (buf) {
+		if (buf->align <= ULONG_MAX)
+			align = buf->align;
+		bigcpm_buf_put(buf);
 	}
-        return 0;
+	if ((flags & MAP_FIXED) || align <= PAGE_SIZE || len + align < len)
+		return current->mm->get_unmapped_area(file, addr, len, pgoff,
+				flags);
+
+	area = current->mm->get_unmapped_area(file, 0, len + align, pgoff,
+			flags);
+	if (IS_ERR_VALUE(area))
+		return current->mm->get_unmapped_area(file, addr, len, pgoff,
+				flags);
+	off &= align - 1;
+	return ALIGN(area - off, align) + off;
 }
 
 static struct file_operations bigcpm_fops =
@@ -435,10 +1995,14 @@ static struct file_operations bigcpm_fops =
     .open = bigcpm_open,
     .release = bigcpm_close,
     .mmap     = bigcpm_mmap,
+    .get_unmapped_area = bigcpm_get_unmapped_area,
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
     .ioctl =bigcpm_ioctl
 #else
-    .unlocked_ioctl = bigcpm_ioctl
+    .unlocked_ioctl = bigcpm_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl = bigcpm_compat_ioctl,
+#endif
 #endif
 };
 
@@ -446,10 +2010,23 @@ static int bigcpm_init(void)
 {
     int ret;
     struct device *dev_ret;
+    int handle;
 
+    BUILD_BUG_ON(sizeof(bigcpm_meta_t) > PAGE_SIZE);
+    bigcpm_meta = (bigcpm_meta_t *) get_zeroed_page(GFP_KERNEL);
+    if (!bigcpm_meta)
+        return -ENOMEM;
+    bigcpm_meta->version = BIGCPM_META_VERSION;
+    bigcpm_meta->nr_bufs = BIGCPM_MAX_BUFS;
+    for (handle = 0; handle < BIGCPM_MAX_BUFS; handle++)
+    {
+        bigcpm_meta->bufs[handle].handle = handle;
+        bigcpm_meta->bufs[handle].node = -1;
+    }
 	 
     if ((ret = alloc_chrdev_region(&dev, FIRST_MINOR, MINOR_CNT, "bigcpm_region")) < 0)
     {
+        free_page((unsigned long) bigcpm_meta);
         return ret;
     }
  
@@ -457,6 +2034,7 @@ static int bigcpm_init(void)
  
     if ((ret = cdev_add(&c_dev, dev, MINOR_CNT)) < 0)
     {
+        free_page((unsigned long) bigcpm_meta);
         return ret;
     }
      
@@ -464,6 +2042,7 @@ static int bigcpm_init(void)
     {
         cdev_del(&c_dev);
         unregister_chrdev_region(dev, MINOR_CNT);
+        free_page((unsigned long) bigcpm_meta);
         return PTR_ERR(cl);
     }
     if (IS_ERR(dev_ret = device_create(cl, NULL, dev, NULL, "bigcpm")))
@@ -471,6 +2050,7 @@ static int bigcpm_init(void)
         class_destroy(cl);
         cdev_del(&c_dev);
         unregister_chrdev_region(dev, MINOR_CNT);
+        free_page((unsigned long) bigcpm_meta);
         return PTR_ERR(dev_ret);
     }
  
@@ -479,15 +2059,16 @@ static int bigcpm_init(void)
 
 static void bigcpm_exit(void)
 {
-   if ( allocated && bigcpm_info.huge_block) {
-		printk(KERN_INFO "Freeing block at 0x%lx.\n",
-			(ulong) page_to_phys(bigcpm_info.huge_block));
-		bigbuf_free(bigcpm_info.huge_block, bigcpm_info.size);
-	}
+   int handle;
+
+   for (handle = 0; handle < BIGCPM_MAX_BUFS; handle++)
+		bigcpm_buf_destroy(handle);
+   flush_work(&bigcpm_free_work);
     device_destroy(cl, dev);
     class_destroy(cl);
     cdev_del(&c_dev);
     unregister_chrdev_region(dev, MINOR_CNT);
+    free_page((unsigned long) bigcpm_meta);
 
 }
 
@@ -0,0 +1,489 @@
+/*
+ * Copy, fill and compare kernels for the bigcpm mapping. See bigcpm_mem.h.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ALTIVEC__)
+#define HAVE_ALTIVEC 1
+#include <altivec.h>
+#include <sys/auxv.h>
+#ifndef PPC_FEATURE_HAS_ALTIVEC
+#define PPC_FEATURE_HAS_ALTIVEC 0x10000000
+#endif
+#endif
+
+#include "bigcpm_mem.h"
+
+#define CACHELINE 64
+
+/*
+ * Below this the sfence that ends a run of non-temporal stores costs more
+ * than the copy itself, so short requests take the plain word-sized path.
+ */
+#define STREAM_MIN 512
+
+/* Bytes needed to bring p up to an align boundary, capped at n. */
+static size_t head_bytes(const void *p, size_t align, size_t n)
+{
+	size_t head = (-(uintptr_t)p) & (align - 1);
+
+	return head < n ? head : n;
+}
+
+/*
+ * Portable versions: word sized accesses, one cache line per iteration,
+ * so uncached memory sees full-width bus cycles instead of byte loops.
+ */
+
+static void copy_generic(void *dst, const void *src, size_t n)
+{
+	size_t head = head_bytes(dst, sizeof(uint64_t), n);
+	char *d = dst;
+	const char *s = src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE, s += CACHELINE) {
+		uint64_t w[CACHELINE / sizeof(uint64_t)];
+
+		memcpy(w, s, CACHELINE);
+		memcpy(d, w, CACHELINE);
+	}
+	memcpy(d, s, n);
+}
+
+static void fill_generic(void *dst, int c, size_t n)
+{
+	size_t head = head_bytes(dst, sizeof(uint64_t), n);
+	uint64_t w = 0x0101010101010101ULL * (uint8_t)c;
+	uint64_t *d;
+	char *p = dst;
+
+	memset(p, c, head);
+	p += head;
+	n -= head;
+	for (d = (uint64_t *)p; n >= CACHELINE; n -= CACHELINE, d += 8) {
+		d[0] = w; d[1] = w; d[2] = w; d[3] = w;
+		d[4] = w; d[5] = w; d[6] = w; d[7] = w;
+	}
+	memset(d, c, n);
+}
+
+static int compare_generic(const void *dev, const void *buf, size_t n)
+{
+	const char *a = dev, *b = buf;
+
+	for (; n >= CACHELINE; n -= CACHELINE, a += CACHELINE, b += CACHELINE) {
+		uint64_t wa[CACHELINE / sizeof(uint64_t)];
+
+		memcpy(wa, a, CACHELINE);
+		if (memcmp(wa, b, CACHELINE))
+			return memcmp(wa, b, CACHELINE);
+	}
+	return memcmp(a, b, n);
+}
+
+#ifdef HAVE_X86
+/*
+ * SSE2: movntdq stores. Streaming loads (movntdqa) need SSE4.1 and are
+ * used for reads from the region when available. Each routine carries
+ * its own target attribute so the library builds for plain i386 too;
+ * impls[] only hands them out once the CPU says it can run them.
+ */
+
+__attribute__((target("sse2")))
+static void copy_to_sse2(void *dst, const void *src, size_t n)
+{
+	size_t head = head_bytes(dst, 16, n);
+	char *d = dst;
+	const char *s = src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE, s += CACHELINE) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)s);
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)d, x0);
+		_mm_stream_si128((__m128i *)(d + 16), x1);
+		_mm_stream_si128((__m128i *)(d + 32), x2);
+		_mm_stream_si128((__m128i *)(d + 48), x3);
+	}
+	for (; n >= 16; n -= 16, d += 16, s += 16)
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(void *dst, int c, size_t n)
+{
+	size_t head = head_bytes(dst, 16, n);
+	__m128i x = _mm_set1_epi8((char)c);
+	char *d = dst;
+
+	memset(d, c, head);
+	d += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE) {
+		_mm_stream_si128((__m128i *)d, x);
+		_mm_stream_si128((__m128i *)(d + 16), x);
+		_mm_stream_si128((__m128i *)(d + 32), x);
+		_mm_stream_si128((__m128i *)(d + 48), x);
+	}
+	for (; n >= 16; n -= 16, d += 16)
+		_mm_stream_si128((__m128i *)d, x);
+	_mm_sfence();
+	memset(d, c, n);
+}
+
+__attribute__((target("sse4.1")))
+static void copy_from_sse41(void *dst, const void *src, size_t n)
+{
+	size_t head = head_bytes(src, 16, n);
+	char *d = dst;
+	const char *s = src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE, s += CACHELINE) {
+		__m128i x0 = _mm_stream_load_si128((__m128i *)s);
+		__m128i x1 = _mm_stream_load_si128((__m128i *)(s + 16));
+		__m128i x2 = _mm_stream_load_si128((__m128i *)(s + 32));
+		__m128i x3 = _mm_stream_load_si128((__m128i *)(s + 48));
+
+		_mm_storeu_si128((__m128i *)d, x0);
+		_mm_storeu_si128((__m128i *)(d + 16), x1);
+		_mm_storeu_si128((__m128i *)(d + 32), x2);
+		_mm_storeu_si128((__m128i *)(d + 48), x3);
+	}
+	memcpy(d, s, n);
+}
+
+/* First differing byte of a vector block; mask has a bit set per equal byte. */
+static int block_diff(const char *a, const char *b, unsigned int mask)
+{
+	unsigned int i = __builtin_ctz(~mask);
+
+	return (unsigned char)a[i] - (unsigned char)b[i];
+}
+
+__attribute__((target("sse2")))
+static int compare_sse2(const void *dev, const void *buf, size_t n)
+{
+	const char *a = dev, *b = buf;
+
+	for (; n >= 16; n -= 16, a += 16, b += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)a);
+		__m128i y = _mm_loadu_si128((const __m128i *)b);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+		if (mask != 0xffff)
+			return block_diff(a, b, mask | 0xffff0000u);
+	}
+	return memcmp(a, b, n);
+}
+
+/* As compare_sse2, reading the region side with streaming loads. */
+__attribute__((target("sse4.1")))
+static int compare_sse41(const void *dev, const void *buf, size_t n)
+{
+	size_t head = head_bytes(dev, 16, n);
+	const char *a = dev, *b = buf;
+	int diff = memcmp(a, b, head);
+
+	if (diff)
+		return diff;
+	a += head;
+	b += head;
+	n -= head;
+	for (; n >= 16; n -= 16, a += 16, b += 16) {
+		__m128i x = _mm_stream_load_si128((__m128i *)a);
+		__m128i y = _mm_loadu_si128((const __m128i *)b);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+		if (mask != 0xffff)
+			return block_diff(a, b, mask | 0xffff0000u);
+	}
+	return memcmp(a, b, n);
+}
+
+__attribute__((target("avx2")))
+static void copy_to_avx2(void *dst, const void *src, size_t n)
+{
+	size_t head = head_bytes(dst, 32, n);
+	char *d = dst;
+	const char *s = src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE, s += CACHELINE) {
+		__m256i y0 = _mm256_loadu_si256((const __m256i *)s);
+		__m256i y1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+
+		_mm256_stream_si256((__m256i *)d, y0);
+		_mm256_stream_si256((__m256i *)(d + 32), y1);
+	}
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+
+__attribute__((target("avx2")))
+static void copy_from_avx2(void *dst, const void *src, size_t n)
+{
+	size_t head = head_bytes(src, 32, n);
+	char *d = dst;
+	const char *s = src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE, s += CACHELINE) {
+		__m256i y0 = _mm256_stream_load_si256((__m256i *)s);
+		__m256i y1 = _mm256_stream_load_si256((__m256i *)(s + 32));
+
+		_mm256_storeu_si256((__m256i *)d, y0);
+		_mm256_storeu_si256((__m256i *)(d + 32), y1);
+	}
+	memcpy(d, s, n);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(void *dst, int c, size_t n)
+{
+	size_t head = head_bytes(dst, 32, n);
+	__m256i y = _mm256_set1_epi8((char)c);
+	char *d = dst;
+
+	memset(d, c, head);
+	d += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE) {
+		_mm256_stream_si256((__m256i *)d, y);
+		_mm256_stream_si256((__m256i *)(d + 32), y);
+	}
+	_mm_sfence();
+	memset(d, c, n);
+}
+
+__attribute__((target("avx2")))
+static int compare_avx2(const void *dev, const void *buf, size_t n)
+{
+	size_t head = head_bytes(dev, 32, n);
+	const char *a = dev, *b = buf;
+	int diff = memcmp(a, b, head);
+
+	if (diff)
+		return diff;
+	a += head;
+	b += head;
+	n -= head;
+	for (; n >= 32; n -= 32, a += 32, b += 32) {
+		__m256i x = _mm256_stream_load_si256((__m256i *)a);
+		__m256i y = _mm256_loadu_si256((const __m256i *)b);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+		if (mask != 0xffffffffu)
+			return block_diff(a, b, mask);
+	}
+	return memcmp(a, b, n);
+}
+#endif /* HAVE_X86 */
+
+#ifdef HAVE_ALTIVEC
+/*
+ * AltiVec has no non-temporal stores; the nearest thing is the transient
+ * forms. lvxl/stvxl mark the line least recently used so it is the next
+ * one evicted, and dcbt/dcbtst with a transient hint (__builtin_prefetch
+ * locality 0) fetch the lines a few iterations ahead. dcbz would save
+ * reading destination lines, but it faults on cache-inhibited mappings.
+ */
+
+#define PREFETCH_AHEAD (4 * CACHELINE)
+
+static void copy_altivec(void *dst, const void *src, size_t n)
+{
+	size_t head = head_bytes(dst, 16, n);
+	char *d = dst;
+	const char *s = src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	if ((uintptr_t)s & 15) {
+		copy_generic(d, s, n);
+		return;
+	}
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE, s += CACHELINE) {
+		vector unsigned char v0, v1, v2, v3;
+
+		__builtin_prefetch(s + PREFETCH_AHEAD, 0, 0);
+		__builtin_prefetch(d + PREFETCH_AHEAD, 1, 0);
+		v0 = vec_ldl(0, (const unsigned char *)s);
+		v1 = vec_ldl(16, (const unsigned char *)s);
+		v2 = vec_ldl(32, (const unsigned char *)s);
+		v3 = vec_ldl(48, (const unsigned char *)s);
+		vec_stl(v0, 0, (unsigned char *)d);
+		vec_stl(v1, 16, (unsigned char *)d);
+		vec_stl(v2, 32, (unsigned char *)d);
+		vec_stl(v3, 48, (unsigned char *)d);
+	}
+	memcpy(d, s, n);
+}
+
+static void fill_altivec(void *dst, int c, size_t n)
+{
+	size_t head = head_bytes(dst, 16, n);
+	vector unsigned char v = vec_splats((unsigned char)c);
+	char *d = dst;
+
+	memset(d, c, head);
+	d += head;
+	n -= head;
+	for (; n >= CACHELINE; n -= CACHELINE, d += CACHELINE) {
+		__builtin_prefetch(d + PREFETCH_AHEAD, 1, 0);
+		vec_stl(v, 0, (unsigned char *)d);
+		vec_stl(v, 16, (unsigned char *)d);
+		vec_stl(v, 32, (unsigned char *)d);
+		vec_stl(v, 48, (unsigned char *)d);
+	}
+	memset(d, c, n);
+}
+#endif /* HAVE_ALTIVEC */
+
+struct mem_impl {
+	const char *name;
+	int (*usable)(void);
+	void (*copy_to)(void *, const void *, size_t);
+	void (*copy_from)(void *, const void *, size_t);
+	void (*fill)(void *, int, size_t);
+	int (*compare)(const void *, const void *, size_t);
+};
+
+static int always(void)
+{
+	return 1;
+}
+
+#ifdef HAVE_X86
+static int has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int has_sse41(void)
+{
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static int has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef HAVE_ALTIVEC
+static int has_altivec(void)
+{
+	return !!(getauxval(AT_HWCAP) & PPC_FEATURE_HAS_ALTIVEC);
+}
+#endif
+
+/* In order of preference. */
+static const struct mem_impl impls[] = {
+#ifdef HAVE_X86
+	{ "avx2", has_avx2, copy_to_avx2, copy_from_avx2, fill_avx2, compare_avx2 },
+	{ "sse4.1", has_sse41, copy_to_sse2, copy_from_sse41, fill_sse2, compare_sse41 },
+	{ "sse2", has_sse2, copy_to_sse2, copy_generic, fill_sse2, compare_sse2 },
+#endif
+#ifdef HAVE_ALTIVEC
+	{ "altivec", has_altivec, copy_altivec, copy_altivec, fill_altivec, compare_generic },
+#endif
+	{ "generic", always, copy_generic, copy_generic, fill_generic, compare_generic },
+};
+
+#define NR_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static const struct mem_impl *impl = &impls[NR_IMPLS - 1];
+
+int bigcpm_mem_select(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_IMPLS; i++) {
+		if (!strcmp(impls[i].name, name) && impls[i].usable()) {
+			impl = &impls[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+__attribute__((constructor))
+static void bigcpm_mem_init(void)
+{
+	const char *name = getenv("BIGCPM_MEM_IMPL");
+	unsigned int i;
+
+	if (name && !bigcpm_mem_select(name))
+		return;
+	for (i = 0; i < NR_IMPLS; i++)
+		if (!bigcpm_mem_select(impls[i].name))
+			return;
+}
+
+void bigcpm_copy_to(void *dev, const void *src, size_t n)
+{
+	if (n < STREAM_MIN)
+		copy_generic(dev, src, n);
+	else
+		impl->copy_to(dev, src, n);
+}
+
+void bigcpm_copy_from(void *dst, const void *dev, size_t n)
+{
+	impl->copy_from(dst, dev, n);
+}
+
+void bigcpm_fill(void *dev, int c, size_t n)
+{
+	if (n < STREAM_MIN)
+		fill_generic(dev, c, n);
+	else
+		impl->fill(dev, c, n);
+}
+
+int bigcpm_compare(const void *dev, const void *buf, size_t n)
+{
+	return impl->compare(dev, buf, n);
+}
+
+const char *bigcpm_mem_impl(void)
+{
+	return impl->name;
+}
+
+const char *bigcpm_mem_impl_name(unsigned int i)
+{
+	return i < NR_IMPLS ? impls[i].name : NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef BIGCPM_MEM_H
+#define BIGCPM_MEM_H
+
+/*
+ * Copy, fill and compare routines for the bigcpm mapping.
+ *
+ * "dev" arguments point into the DMA region. On x86, writes to it use
+ * non-temporal stores so staging a payload neither pollutes the cache
+ * nor reads the destination lines first, and reads from it (copies and
+ * compares) use streaming loads where the CPU has them. AltiVec has no
+ * such stores and uses the transient load, store and prefetch forms
+ * instead, which keep the lines they touch first in line for eviction.
+ * Everything is done in cache-line sized chunks once the device side is
+ * aligned; requests of a few hundred bytes use ordinary word stores,
+ * where the fence would dominate.
+ *
+ * The implementation is picked at startup from what the CPU supports
+ * (AVX2, SSE4.1, SSE2, AltiVec, or portable C), and can be forced with
+ * the BIGCPM_MEM_IMPL environment variable or bigcpm_mem_select().
+ */
+
+#include <stddef.h>
+
+/* Copy n bytes from normal memory into the region. */
+void bigcpm_copy_to(void *dev, const void *src, size_t n);
+
+/* Copy n bytes from the region into normal memory. */
+void bigcpm_copy_from(void *dst, const void *dev, size_t n);
+
+/* Fill n bytes of the region with c. */
+void bigcpm_fill(void *dev, int c, size_t n);
+
+/* Compare n bytes of the region with buf, memcmp() style. */
+int bigcpm_compare(const void *dev, const void *buf, size_t n);
+
+/* Name of the implementation in use. */
+const char *bigcpm_mem_impl(void);
+
+/*
+ * Use the named implementation ("generic", "sse2", "sse4.1", "avx2",
+ * "altivec"). Returns 0, or -1 if it is unknown or the CPU can't run it.
+ */
+int bigcpm_mem_select(const char *name);
+
+/* Name of the i-th implementation built into the library, NULL past the end. */
+const char *bigcpm_mem_impl_name(unsigned int i);
+
+#endif
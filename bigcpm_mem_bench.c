@@ -0,0 +1,222 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bigcpm_ioctl.h"
+#include "bigcpm_mem.h"
+
+#define ALLOC_SIZE (16*1024*1024)
+
+static const size_t sizes[] = { 64, 1500, 64 * 1024, 4 * 1024 * 1024 };
+
+static size_t total = 64 * 1024 * 1024;	/* bytes moved per measurement */
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void libc_copy_to(void *dev, const void *src, size_t n) { memcpy(dev, src, n); }
+static void libc_copy_from(void *dst, const void *dev, size_t n) { memcpy(dst, dev, n); }
+static void libc_fill(void *dev, int c, size_t n) { memset(dev, c, n); }
+static int libc_compare(const void *dev, const void *buf, size_t n) { return memcmp(dev, buf, n); }
+
+struct ops {
+	void (*copy_to)(void *, const void *, size_t);
+	void (*copy_from)(void *, const void *, size_t);
+	void (*fill)(void *, int, size_t);
+	int (*compare)(const void *, const void *, size_t);
+};
+
+static const struct ops libc_ops = { libc_copy_to, libc_copy_from, libc_fill, libc_compare };
+static const struct ops lib_ops = { bigcpm_copy_to, bigcpm_copy_from, bigcpm_fill, bigcpm_compare };
+
+/* Run one operation over the region in chunks of size, return MB/s. */
+static double run(const struct ops *o, int op, char *dev, char *buf, size_t size)
+{
+	size_t span = ALLOC_SIZE - ALLOC_SIZE % size;
+	size_t done, off = 0;
+	double t0 = now();
+	volatile int sink = 0;
+
+	for (done = 0; done < total; done += size) {
+		switch (op) {
+		case 0: o->copy_to(dev + off, buf + off, size); break;
+		case 1: o->copy_from(buf + off, dev + off, size); break;
+		case 2: o->fill(dev + off, 0x5a, size); break;
+		case 3: sink += o->compare(dev + off, buf + off, size); break;
+		}
+		off = (off + size) % span;
+	}
+	(void)sink;
+	return total / (now() - t0) / 1e6;
+}
+
+/*
+ * Every implementation must agree with libc: copies and fills byte for
+ * byte, compare in the sign of its result. Odd offsets and a length that
+ * is not a multiple of a line exercise the head and tail paths. Returns
+ * the number of failures.
+ */
+static int check(const char *mapping, char *dev, char *buf)
+{
+	static const size_t len = 100000;
+	char *tmp = malloc(len + 16);
+	const char *impl;
+	int failed = 0, r;
+	unsigned int i;
+
+	if (!tmp)
+		return 1;
+	for (i = 0; (impl = bigcpm_mem_impl_name(i)); i++) {
+		if (bigcpm_mem_select(impl))
+			continue;
+
+		bigcpm_copy_to(dev + 3, buf + 5, len);
+		if (memcmp(dev + 3, buf + 5, len)) {
+			printf("%s: %s copy_to mismatch\n", mapping, impl);
+			failed++;
+		}
+
+		memset(tmp, 0, len + 16);
+		bigcpm_copy_from(tmp + 7, dev + 3, len);
+		if (memcmp(tmp + 7, buf + 5, len) || tmp[6] || tmp[len + 7]) {
+			printf("%s: %s copy_from mismatch\n", mapping, impl);
+			failed++;
+		}
+
+		memset(tmp, 0xa5, len + 16);
+		dev[2] = dev[len + 3] = 0;
+		bigcpm_fill(dev + 3, 0xa5, len);
+		if (memcmp(dev + 3, tmp, len) || dev[2] || dev[len + 3]) {
+			printf("%s: %s fill mismatch\n", mapping, impl);
+			failed++;
+		}
+
+		/* equal, then one byte differing near the tail both ways */
+		memcpy(dev + 3, buf + 5, len);
+		memcpy(tmp, buf + 5, len);
+		r = bigcpm_compare(dev + 3, tmp, len);
+		if (r) {
+			printf("%s: %s compare of equal data gave %d\n",
+				mapping, impl, r);
+			failed++;
+		}
+		tmp[len - 10] = dev[len - 7] + 1;
+		r = bigcpm_compare(dev + 3, tmp, len);
+		if ((r < 0) != (memcmp(dev + 3, tmp, len) < 0) || !r) {
+			printf("%s: %s compare gave %d, memcmp %d\n", mapping,
+				impl, r, memcmp(dev + 3, tmp, len));
+			failed++;
+		}
+		tmp[len - 10] = dev[len - 7] - 1;
+		r = bigcpm_compare(dev + 3, tmp, len);
+		if ((r < 0) != (memcmp(dev + 3, tmp, len) < 0) || !r) {
+			printf("%s: %s compare gave %d, memcmp %d\n", mapping,
+				impl, r, memcmp(dev + 3, tmp, len));
+			failed++;
+		}
+	}
+	free(tmp);
+	return failed;
+}
+
+static int bench(const char *mapping, char *dev, char *buf)
+{
+	static const char *op_names[] = { "copy_to", "copy_from", "fill", "compare" };
+	const char *impl;
+	unsigned int i, s;
+	int op;
+
+	if (check(mapping, dev, buf))
+		return 1;
+
+	for (op = 0; op < 4; op++) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			/* compare must walk equal data to measure a full pass */
+			if (op == 3)
+				memcpy(dev, buf, ALLOC_SIZE);
+			printf("%-8s %-9s %8zu  libc %8.0f", mapping, op_names[op],
+				sizes[s], run(&libc_ops, op, dev, buf, sizes[s]));
+			for (i = 0; (impl = bigcpm_mem_impl_name(i)); i++) {
+				if (bigcpm_mem_select(impl))
+					continue;
+				printf("  %s %8.0f", impl,
+					run(&lib_ops, op, dev, buf, sizes[s]));
+			}
+			printf("  MB/s\n");
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char *file_name = "/dev/bigcpm";
+	bigcpm_alloc_arg_t a;
+	char *buf, *dev;
+	int anon = 0;
+	int fd, c, failed;
+
+	while ((c = getopt(argc, argv, "at:")) != -1)
+		switch (c) {
+		case 'a':	/* anonymous memory baseline, no driver needed */
+			anon = 1;
+			break;
+		case 't':
+			total = strtoul(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a] [-t MB per test]\n", argv[0]);
+			return 1;
+		}
+
+	buf = aligned_alloc(4096, ALLOC_SIZE);
+	for (c = 0; c < ALLOC_SIZE; c++)
+		buf[c] = c * 7;
+
+	if (anon) {
+		dev = mmap(0, ALLOC_SIZE, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		return bench("anon", dev, buf);
+	}
+
+	fd = open(file_name, O_RDWR);
+	if (fd == -1) {
+		perror("apps open");
+		return 2;
+	}
+	memset(&a, 0, sizeof(a));
+	a.size = ALLOC_SIZE;
+	if (ioctl(fd, BIGCPM_ALLOC_EX, &a) == -1) {
+		printf("BIGCPM_ALLOC_EX failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	dev = mmap(0, ALLOC_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+			BIGCPM_MMAP_OFFSET(a.handle));
+	if (dev == MAP_FAILED) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return 1;
+	}
+	failed = bench("cached", dev, buf);
+	munmap(dev, ALLOC_SIZE);
+
+	{
+		bigcpm_buf_arg_t b = { .handle = a.handle };
+		ioctl(fd, BIGCPM_BUF_RELEASE, &b);
+	}
+	close(fd);
+	return failed;
+}
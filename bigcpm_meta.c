@@ -0,0 +1,42 @@
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bigcpm_meta.h"
+
+const bigcpm_meta_t *bigcpm_meta_map(int fd)
+{
+	const bigcpm_meta_t *meta;
+
+	meta = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd,
+			BIGCPM_META_OFFSET);
+	if (meta == MAP_FAILED)
+		return NULL;
+	if (meta->version != BIGCPM_META_VERSION) {
+		bigcpm_meta_unmap(meta);
+		errno = EPROTO;
+		return NULL;
+	}
+	return meta;
+}
+
+void bigcpm_meta_unmap(const bigcpm_meta_t *meta)
+{
+	munmap((void *)meta, sysconf(_SC_PAGESIZE));
+}
+
+int bigcpm_meta_find_phys(const bigcpm_meta_t *meta, uint64_t phys,
+		bigcpm_meta_entry_t *e)
+{
+	unsigned int h;
+
+	for (h = 0; h < meta->nr_bufs; h++) {
+		if (bigcpm_meta_lookup(meta, h, e) ||
+		    !e->paddr)
+			continue;
+		if (phys >= e->paddr && phys - e->paddr < e->size)
+			return h;
+	}
+	return -1;
+}
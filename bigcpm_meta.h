@@ -0,0 +1,66 @@
+#ifndef BIGCPM_META_H
+#define BIGCPM_META_H
+
+/*
+ * System-call free view of the driver's buffer table.
+ *
+ * The driver publishes handle, physical base, size and NUMA node of every
+ * buffer in a read-only page at BIGCPM_META_OFFSET. Lookups copy an entry
+ * under the page's sequence counter, and a cached entry can be
+ * revalidated by checking that its slot generation hasn't moved.
+ */
+
+#include <stdint.h>
+
+#include "bigcpm_ioctl.h"
+
+/* Map the metadata page of an open /dev/bigcpm. Returns NULL with errno set. */
+const bigcpm_meta_t *bigcpm_meta_map(int fd);
+
+void bigcpm_meta_unmap(const bigcpm_meta_t *meta);
+
+/*
+ * Find the contiguous buffer holding physical address phys and copy its
+ * entry to e. Returns the handle, or -1 if no buffer covers phys.
+ */
+int bigcpm_meta_find_phys(const bigcpm_meta_t *meta, uint64_t phys,
+		bigcpm_meta_entry_t *e);
+
+/*
+ * Copy a consistent snapshot of buffer handle's entry to e.
+ * Returns 0, or -1 if handle is out of range or has no buffer.
+ */
+static inline int bigcpm_meta_lookup(const bigcpm_meta_t *meta,
+		unsigned int handle, bigcpm_meta_entry_t *e)
+{
+	uint32_t seq;
+
+	if (handle >= meta->nr_bufs)
+		return -1;
+	do {
+		while ((seq = __atomic_load_n(&meta->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		*e = meta->bufs[handle];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&meta->seq, __ATOMIC_RELAXED) != seq);
+	return e->size ? 0 : -1;
+}
+
+/* Nonzero while the buffer e was copied from is still the one in its slot. */
+static inline int bigcpm_meta_valid(const bigcpm_meta_t *meta,
+		const bigcpm_meta_entry_t *e)
+{
+	return __atomic_load_n(&meta->bufs[e->handle].generation,
+			__ATOMIC_ACQUIRE) == e->generation;
+}
+
+/* Physical address of offset off in the buffer, 0 if out of range or not contiguous. */
+static inline uint64_t bigcpm_meta_phys(const bigcpm_meta_entry_t *e,
+		uint64_t off)
+{
+	if (off >= e->size || !e->paddr)
+		return 0;
+	return e->paddr + off;
+}
+
+#endif
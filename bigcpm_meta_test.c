@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bigcpm_ioctl.h"
+#include "bigcpm_meta.h"
+
+#define ALLOC_SIZE (8*1024*1024)
+#define LOOKUPS    1000000
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	char *file_name = "/dev/bigcpm";
+	const bigcpm_meta_t *meta;
+	bigcpm_meta_entry_t e;
+	bigcpm_alloc_arg_t a[2];
+	bigcpm_buf_arg_t b;
+	double t0, t1, t2;
+	unsigned int h;
+	int fd, i, failed = 0;
+
+	fd = open(file_name, O_RDWR);
+	if (fd == -1) {
+		perror("apps open");
+		return 2;
+	}
+	for (i = 0; i < 2; i++) {
+		memset(&a[i], 0, sizeof(a[i]));
+		a[i].size = ALLOC_SIZE;
+		if (ioctl(fd, BIGCPM_ALLOC_EX, &a[i]) == -1) {
+			printf("BIGCPM_ALLOC_EX failed: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	meta = bigcpm_meta_map(fd);
+	if (!meta) {
+		printf("mapping the metadata page failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("table generation %llu\n", (unsigned long long)meta->generation);
+	for (h = 0; h < meta->nr_bufs; h++) {
+		if (bigcpm_meta_lookup(meta, h, &e))
+			continue;
+		printf("  handle %u: phys 0x%llx size 0x%llx node %d gen %u%s\n",
+			e.handle, (unsigned long long)e.paddr,
+			(unsigned long long)e.size, e.node, e.generation,
+			e.flags & BIGCPM_META_COLORED ? " colored" : "");
+	}
+
+	/* the page must agree with the ioctl */
+	for (i = 0; i < 2; i++) {
+		b.handle = a[i].handle;
+		if (ioctl(fd, BIGCPM_BUF_GET, &b) == -1 ||
+		    bigcpm_meta_lookup(meta, a[i].handle, &e) ||
+		    e.paddr != b.paddr || e.size != b.size) {
+			printf("handle %llu: metadata does not match BIGCPM_BUF_GET\n",
+				(unsigned long long)a[i].handle);
+			failed++;
+		}
+	}
+	if (bigcpm_meta_find_phys(meta, a[1].paddr + 4096, &e) !=
+	    (int)a[1].handle) {
+		printf("bigcpm_meta_find_phys failed\n");
+		failed++;
+	}
+
+	t0 = now();
+	for (i = 0; i < LOOKUPS; i++)
+		bigcpm_meta_lookup(meta, a[0].handle, &e);
+	t1 = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		b.handle = a[0].handle;
+		ioctl(fd, BIGCPM_BUF_GET, &b);
+	}
+	t2 = now();
+	printf("lookup: %.1f ns from the page, %.1f ns by ioctl\n",
+		(t1 - t0) * 1e9 / LOOKUPS, (t2 - t1) * 1e9 / LOOKUPS);
+
+	/* a released slot must invalidate cached entries */
+	bigcpm_meta_lookup(meta, a[1].handle, &e);
+	b.handle = a[1].handle;
+	ioctl(fd, BIGCPM_BUF_RELEASE, &b);
+	if (bigcpm_meta_valid(meta, &e)) {
+		printf("generation did not change on release\n");
+		failed++;
+	}
+
+	b.handle = a[0].handle;
+	ioctl(fd, BIGCPM_BUF_RELEASE, &b);
+	bigcpm_meta_unmap(meta);
+	close(fd);
+	if (failed)
+		printf("%d checks failed\n", failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * Fixed-size buffer pools over the bigcpm mapping. See bigcpm_pool.h.
+ *
+ * The free ring is the bounded MPMC queue described by D. Vyukov: every
+ * cell carries a sequence number telling producers and consumers whether
+ * it is theirs to use, so a single CAS on the position claims a cell and
+ * there is no ABA window.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "bigcpm_pool.h"
+#include "bigcpm_internal.h"
+
+static uint32_t ring_capacity(uint32_t nr_bufs)
+{
+	uint32_t cap = 1;
+
+	while (cap < nr_bufs)
+		cap <<= 1;
+	return cap;
+}
+
+static uint64_t ring_offset(void)
+{
+	return ALIGN_UP(sizeof(struct bigcpm_pool_hdr), BIGCPM_POOL_CACHELINE);
+}
+
+static uint64_t bufs_offset(uint32_t nr_bufs)
+{
+	return ALIGN_UP(ring_offset() + (uint64_t)ring_capacity(nr_bufs) *
+			sizeof(struct bigcpm_pool_cell), BIGCPM_POOL_CACHELINE);
+}
+
+size_t bigcpm_pool_footprint(uint32_t buf_size, uint32_t nr_bufs)
+{
+	buf_size = ALIGN_UP(buf_size, BIGCPM_POOL_CACHELINE);
+	return bufs_offset(nr_bufs) + (uint64_t)buf_size * nr_bufs;
+}
+
+static void pool_bind(struct bigcpm_pool *pool, struct bigcpm_pool_hdr *hdr)
+{
+	pool->hdr = hdr;
+	pool->ring = (struct bigcpm_pool_cell *)((char *)hdr + hdr->ring_off);
+	pool->bufs = (char *)hdr + hdr->bufs_off;
+	pool->bufs_phys = hdr->phys_base + hdr->bufs_off;
+	pool->buf_size = hdr->buf_size;
+	pool->nr_bufs = hdr->nr_bufs;
+}
+
+int bigcpm_pool_create(struct bigcpm_pool *pool, void *area, size_t area_len,
+		uint64_t phys, uint32_t buf_size, uint32_t nr_bufs)
+{
+	struct bigcpm_pool_hdr *hdr = area;
+	struct bigcpm_pool_cell *ring;
+	uint32_t i;
+
+	if (!buf_size || !nr_bufs || nr_bufs > (1u << 31) ||
+	    ((uintptr_t)area & (BIGCPM_POOL_CACHELINE - 1)) ||
+	    (phys & (BIGCPM_POOL_CACHELINE - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (bigcpm_pool_footprint(buf_size, nr_bufs) > area_len) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->buf_size = ALIGN_UP(buf_size, BIGCPM_POOL_CACHELINE);
+	hdr->nr_bufs = nr_bufs;
+	hdr->ring_mask = ring_capacity(nr_bufs) - 1;
+	hdr->phys_base = phys;
+	hdr->ring_off = ring_offset();
+	hdr->bufs_off = bufs_offset(nr_bufs);
+	hdr->size = bigcpm_pool_footprint(buf_size, nr_bufs);
+
+	/* Every buffer starts out on the ring, in address order. */
+	ring = (struct bigcpm_pool_cell *)((char *)hdr + hdr->ring_off);
+	for (i = 0; i <= hdr->ring_mask; i++) {
+		ring[i].idx = i;
+		ring[i].seq = i < nr_bufs ? i + 1 : i;
+	}
+	hdr->enq_pos = nr_bufs;
+	hdr->deq_pos = 0;
+
+	publish_magic(&hdr->magic, BIGCPM_POOL_MAGIC);
+	pool_bind(pool, hdr);
+	return 0;
+}
+
+int bigcpm_pool_attach(struct bigcpm_pool *pool, void *area, size_t area_len)
+{
+	struct bigcpm_pool_hdr *hdr = area;
+
+	if (area_len < sizeof(*hdr) ||
+	    __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != BIGCPM_POOL_MAGIC ||
+	    hdr->size > area_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	pool_bind(pool, hdr);
+	return 0;
+}
+
+static int ring_put(struct bigcpm_pool *pool, uint32_t idx)
+{
+	struct bigcpm_pool_hdr *hdr = pool->hdr;
+	struct bigcpm_pool_cell *cell;
+	uint32_t pos = __atomic_load_n(&hdr->enq_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		int32_t diff;
+
+		cell = &pool->ring[pos & hdr->ring_mask];
+		diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&hdr->enq_pos, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The cell is still being emptied by a consumer that
+			claimed it a lap ago. Only with more releases than
+			buffers is the ring really full. */
+			if ((int32_t)(pos - __atomic_load_n(&hdr->deq_pos,
+					__ATOMIC_RELAXED)) > (int32_t)hdr->ring_mask)
+				return 0;
+			cpu_relax();
+			pos = __atomic_load_n(&hdr->enq_pos, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&hdr->enq_pos, __ATOMIC_RELAXED);
+		}
+	}
+	cell->idx = idx;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int ring_get(struct bigcpm_pool *pool, uint32_t *idx)
+{
+	struct bigcpm_pool_hdr *hdr = pool->hdr;
+	struct bigcpm_pool_cell *cell;
+	uint32_t pos = __atomic_load_n(&hdr->deq_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		int32_t diff;
+
+		cell = &pool->ring[pos & hdr->ring_mask];
+		diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+				(pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&hdr->deq_pos, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* empty, unless a producer has claimed the cell and
+			not filled it yet */
+			if (__atomic_load_n(&hdr->enq_pos, __ATOMIC_RELAXED) == pos)
+				return 0;
+			cpu_relax();
+			pos = __atomic_load_n(&hdr->deq_pos, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&hdr->deq_pos, __ATOMIC_RELAXED);
+		}
+	}
+	*idx = cell->idx;
+	__atomic_store_n(&cell->seq, pos + hdr->ring_mask + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+unsigned int bigcpm_pool_get_bulk(struct bigcpm_pool *pool,
+		uint32_t *idx, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (!ring_get(pool, &idx[i]))
+			break;
+	return i;
+}
+
+unsigned int bigcpm_pool_put_bulk(struct bigcpm_pool *pool,
+		const uint32_t *idx, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (!ring_put(pool, idx[i]))
+			break;
+	return i;
+}
+
+void bigcpm_pool_cache_init(struct bigcpm_pool_cache *cache,
+		struct bigcpm_pool *pool)
+{
+	cache->pool = pool;
+	cache->count = 0;
+}
+
+/* Fill half a magazine so the next few releases don't spill straight away. */
+int bigcpm_pool_refill(struct bigcpm_pool_cache *cache)
+{
+	cache->count = bigcpm_pool_get_bulk(cache->pool, cache->idx,
+			BIGCPM_POOL_MAG_SIZE / 2);
+	return cache->count;
+}
+
+void bigcpm_pool_spill(struct bigcpm_pool_cache *cache)
+{
+	unsigned int n = BIGCPM_POOL_MAG_SIZE / 2;
+
+	cache->count -= n;
+	bigcpm_pool_put_bulk(cache->pool, &cache->idx[cache->count], n);
+}
+
+void bigcpm_pool_cache_flush(struct bigcpm_pool_cache *cache)
+{
+	bigcpm_pool_put_bulk(cache->pool, cache->idx, cache->count);
+	cache->count = 0;
+}
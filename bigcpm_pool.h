@@ -0,0 +1,168 @@
+#ifndef BIGCPM_POOL_H
+#define BIGCPM_POOL_H
+
+/*
+ * Fixed-size buffer pools carved from the mmapped /dev/bigcpm region.
+ *
+ * The pool header, the free ring and the buffers all live inside the
+ * region and only hold offsets, so every process that maps the same
+ * bigcpm buffer can attach to the pool at its own virtual address.
+ *
+ * The shared free list is a bounded MPMC ring of buffer indices with a
+ * sequence number per cell; it only needs 32-bit CAS, which keeps it
+ * lock-free on powerpc32 as well. Each thread talks to the ring through
+ * a private magazine (struct bigcpm_pool_cache), so most acquire and
+ * release calls never touch shared cache lines.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BIGCPM_POOL_MAGIC	0x62706f6fu	/* "bpoo" */
+#define BIGCPM_POOL_CACHELINE	64
+#define BIGCPM_POOL_MAG_SIZE	32	/* buffers per thread magazine */
+
+/* Shared state, placed at the start of the pool area inside the region. */
+struct bigcpm_pool_hdr {
+	uint32_t magic;
+	uint32_t buf_size;	/* bytes per buffer, cache line multiple */
+	uint32_t nr_bufs;	/* buffers in the pool */
+	uint32_t ring_mask;	/* ring capacity - 1 (power of two) */
+	uint64_t phys_base;	/* physical address of this header */
+	uint64_t ring_off;	/* free ring, from the header */
+	uint64_t bufs_off;	/* first buffer, from the header */
+	uint64_t size;		/* total bytes used by the pool */
+
+	/* producer / consumer positions on their own cache lines */
+	uint32_t enq_pos __attribute__((aligned(BIGCPM_POOL_CACHELINE)));
+	uint32_t deq_pos __attribute__((aligned(BIGCPM_POOL_CACHELINE)));
+} __attribute__((aligned(BIGCPM_POOL_CACHELINE)));
+
+struct bigcpm_pool_cell {
+	uint32_t seq;
+	uint32_t idx;
+};
+
+/* Process-local handle on a pool. */
+struct bigcpm_pool {
+	struct bigcpm_pool_hdr *hdr;
+	struct bigcpm_pool_cell *ring;
+	char *bufs;
+	uint64_t bufs_phys;
+	uint32_t buf_size;
+	uint32_t nr_bufs;
+};
+
+/* Per-thread magazine; never shared between threads. */
+struct bigcpm_pool_cache {
+	struct bigcpm_pool *pool;
+	uint32_t count;
+	uint32_t idx[BIGCPM_POOL_MAG_SIZE];
+};
+
+/*
+ * Bytes of region needed for a pool of nr_bufs buffers of buf_size.
+ */
+size_t bigcpm_pool_footprint(uint32_t buf_size, uint32_t nr_bufs);
+
+/*
+ * Format a new pool at area (cache line aligned, inside the mapping),
+ * whose physical address is phys. All buffers start out free.
+ * Returns 0, or -1 with errno set.
+ */
+int bigcpm_pool_create(struct bigcpm_pool *pool, void *area, size_t area_len,
+		uint64_t phys, uint32_t buf_size, uint32_t nr_bufs);
+
+/*
+ * Attach to a pool created by another thread or process at area.
+ * Returns 0, or -1 with errno set.
+ */
+int bigcpm_pool_attach(struct bigcpm_pool *pool, void *area, size_t area_len);
+
+void bigcpm_pool_cache_init(struct bigcpm_pool_cache *cache,
+		struct bigcpm_pool *pool);
+
+/* Return all buffers held by the magazine to the shared ring. */
+void bigcpm_pool_cache_flush(struct bigcpm_pool_cache *cache);
+
+/* Slow paths, used when the magazine is empty or full. */
+int bigcpm_pool_refill(struct bigcpm_pool_cache *cache);
+void bigcpm_pool_spill(struct bigcpm_pool_cache *cache);
+
+/* Bulk access to the shared ring; returns the number of indices moved. */
+unsigned int bigcpm_pool_get_bulk(struct bigcpm_pool *pool,
+		uint32_t *idx, unsigned int n);
+unsigned int bigcpm_pool_put_bulk(struct bigcpm_pool *pool,
+		const uint32_t *idx, unsigned int n);
+
+/* Buffer handle conversions. */
+static inline void *bigcpm_pool_virt(const struct bigcpm_pool *pool,
+		uint32_t idx)
+{
+	return pool->bufs + (size_t)idx * pool->buf_size;
+}
+
+static inline uint64_t bigcpm_pool_phys(const struct bigcpm_pool *pool,
+		uint32_t idx)
+{
+	return pool->bufs_phys + (uint64_t)idx * pool->buf_size;
+}
+
+static inline uint32_t bigcpm_pool_virt_to_idx(const struct bigcpm_pool *pool,
+		const void *virt)
+{
+	return (uint32_t)(((const char *)virt - pool->bufs) / pool->buf_size);
+}
+
+static inline uint32_t bigcpm_pool_phys_to_idx(const struct bigcpm_pool *pool,
+		uint64_t phys)
+{
+	return (uint32_t)((phys - pool->bufs_phys) / pool->buf_size);
+}
+
+static inline void *bigcpm_pool_ptov(const struct bigcpm_pool *pool,
+		uint64_t phys)
+{
+	return pool->bufs + (size_t)(phys - pool->bufs_phys);
+}
+
+static inline uint64_t bigcpm_pool_vtop(const struct bigcpm_pool *pool,
+		const void *virt)
+{
+	return pool->bufs_phys + (uint64_t)((const char *)virt - pool->bufs);
+}
+
+/* Take a buffer; returns NULL when the pool is exhausted. */
+static inline void *bigcpm_pool_acquire(struct bigcpm_pool_cache *cache)
+{
+	if (!cache->count && !bigcpm_pool_refill(cache))
+		return NULL;
+	return bigcpm_pool_virt(cache->pool, cache->idx[--cache->count]);
+}
+
+/* Give back a buffer obtained from this pool. */
+static inline void bigcpm_pool_release(struct bigcpm_pool_cache *cache,
+		void *buf)
+{
+	if (cache->count == BIGCPM_POOL_MAG_SIZE)
+		bigcpm_pool_spill(cache);
+	cache->idx[cache->count++] = bigcpm_pool_virt_to_idx(cache->pool, buf);
+}
+
+/* Physical-address flavours, as used with BMan-style hardware. */
+static inline uint64_t bigcpm_pool_acquire_phys(struct bigcpm_pool_cache *cache)
+{
+	if (!cache->count && !bigcpm_pool_refill(cache))
+		return 0;
+	return bigcpm_pool_phys(cache->pool, cache->idx[--cache->count]);
+}
+
+static inline void bigcpm_pool_release_phys(struct bigcpm_pool_cache *cache,
+		uint64_t phys)
+{
+	if (cache->count == BIGCPM_POOL_MAG_SIZE)
+		bigcpm_pool_spill(cache);
+	cache->idx[cache->count++] = bigcpm_pool_phys_to_idx(cache->pool, phys);
+}
+
+#endif
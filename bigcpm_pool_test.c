@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "bigcpm_ioctl.h"
+#include "bigcpm_pool.h"
+
+#define ALLOC_SIZE (64*1024*1024)
+#define BUF_SIZE   2048
+#define NR_THREADS 4
+#define ITERATIONS 10000000
+#define NR_PROCS   4
+#define CHECK_ITERATIONS 200000
+
+static struct bigcpm_pool pool;
+
+/* each thread keeps a few buffers in flight, like an rx/tx loop */
+static void *worker(void *arg)
+{
+	struct bigcpm_pool_cache cache;
+	void *held[8];
+	long i;
+	int j;
+
+	(void)arg;
+	bigcpm_pool_cache_init(&cache, &pool);
+	for (i = 0; i < ITERATIONS; i++) {
+		for (j = 0; j < 8; j++) {
+			held[j] = bigcpm_pool_acquire(&cache);
+			if (!held[j]) {
+				printf("pool exhausted\n");
+				return NULL;
+			}
+		}
+		for (j = 0; j < 8; j++)
+			bigcpm_pool_release(&cache, held[j]);
+	}
+	bigcpm_pool_cache_flush(&cache);
+	return NULL;
+}
+
+/*
+* Child process: attach to the pool through the shared mapping and churn
+* buffers, claiming each one by its first word. A buffer that is already
+* claimed has been handed to two owners at once. Returns the error count.
+*/
+static int checker(void *area, uint32_t id)
+{
+	struct bigcpm_pool mine;
+	struct bigcpm_pool_cache cache;
+	uint32_t *held[64];
+	unsigned int n, j;
+	int errors = 0;
+	long i;
+
+	if (bigcpm_pool_attach(&mine, area, ALLOC_SIZE) == -1) {
+		printf("bigcpm_pool_attach failed: %s\n", strerror(errno));
+		return 1;
+	}
+	bigcpm_pool_cache_init(&cache, &mine);
+	for (i = 0; i < CHECK_ITERATIONS && errors < 10; i++) {
+		/* vary the hold count so magazines refill and spill */
+		n = 1 + (i * 7 + id) % 64;
+		for (j = 0; j < n; j++) {
+			uint32_t free_id = 0;
+
+			held[j] = bigcpm_pool_acquire(&cache);
+			if (!held[j]) {
+				printf("proc %u: pool exhausted\n", id);
+				return errors + 1;
+			}
+			if (!__atomic_compare_exchange_n(held[j], &free_id, id, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				printf("proc %u: buffer %u already owned by %u\n",
+					id, bigcpm_pool_virt_to_idx(&mine, held[j]),
+					free_id);
+				errors++;
+			}
+		}
+		while (n) {
+			n--;
+			if (__atomic_exchange_n(held[n], 0, __ATOMIC_RELEASE) != id) {
+				printf("proc %u: buffer %u changed owner\n", id,
+					bigcpm_pool_virt_to_idx(&mine, held[n]));
+				errors++;
+			}
+			bigcpm_pool_release(&cache, held[n]);
+		}
+	}
+	bigcpm_pool_cache_flush(&cache);
+	return errors;
+}
+
+/* Fork NR_PROCS checkers, then make sure every buffer came back once. */
+static int check_processes(void *area)
+{
+	uint32_t idx, *seen;
+	pid_t pid[NR_PROCS];
+	int i, status, failed = 0;
+	unsigned int n = 0, dups = 0;
+
+	fflush(stdout);
+	for (i = 0; i < NR_PROCS; i++) {
+		pid[i] = fork();
+		if (pid[i] == 0)
+			exit(checker(area, i + 1) ? 1 : 0);
+	}
+	for (i = 0; i < NR_PROCS; i++) {
+		waitpid(pid[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	}
+
+	seen = calloc(pool.nr_bufs, sizeof(*seen));
+	while (bigcpm_pool_get_bulk(&pool, &idx, 1)) {
+		if (idx >= pool.nr_bufs || seen[idx]++)
+			dups++;
+		n++;
+	}
+	for (idx = 0; idx < pool.nr_bufs; idx++)
+		if (seen[idx])
+			bigcpm_pool_put_bulk(&pool, &idx, 1);
+	free(seen);
+
+	printf("%d processes: %d failed, %u of %u buffers free, %u duplicates\n",
+		NR_PROCS, failed, n, pool.nr_bufs, dups);
+	return failed || dups || n != pool.nr_bufs;
+}
+
+int main(int argc, char *argv[])
+{
+	char *file_name = "/dev/bigcpm";
+	pthread_t tid[NR_THREADS];
+	struct timespec t0, t1;
+	bigcpm_arg_t q;
+	void *virt;
+	double secs;
+	int anon = 0;
+	int fd = -1, i, c, ret;
+
+	while ((c = getopt(argc, argv, "a")) != -1)
+		switch (c) {
+		case 'a':	/* anonymous shared memory, no driver needed */
+			anon = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a]\n", argv[0]);
+			return 1;
+		}
+
+	if (anon) {
+		q.paddr = 0;
+		virt = mmap(0, ALLOC_SIZE, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	} else {
+		fd = open(file_name, O_RDWR);
+		if (fd == -1) {
+			perror("apps open");
+			return 2;
+		}
+		q.size = ALLOC_SIZE;
+		if (ioctl(fd, BIGCPM_ALLOC, &q) == -1) {
+			printf("BIGCPM_ALLOC, failed: %s\n", strerror(errno));
+			return 1;
+		}
+		if (ioctl(fd, BIGCMP_GET_PHYSADDR, &q) == -1) {
+			printf("BIGCMP_GET_PHYSADDR failed: %s\n", strerror(errno));
+			return 1;
+		}
+		virt = mmap(0, ALLOC_SIZE, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_LOCKED, fd, 0);
+	}
+	if (virt == MAP_FAILED) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* leave room for the header and a ring of up to twice nr_bufs */
+	if (bigcpm_pool_create(&pool, virt, ALLOC_SIZE, q.paddr, BUF_SIZE,
+			(ALLOC_SIZE - 4096) / (BUF_SIZE + 2 * sizeof(struct bigcpm_pool_cell))) == -1) {
+		printf("bigcpm_pool_create failed: %s\n", strerror(errno));
+		return 1;
+	}
+	printf("pool: %u buffers of %u bytes, first at phys 0x%llx\n",
+		pool.nr_bufs, pool.buf_size,
+		(unsigned long long)bigcpm_pool_phys(&pool, 0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_create(&tid[i], NULL, worker, NULL);
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(tid[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%d threads: %.1f M acquire+release/s\n", NR_THREADS,
+		(double)NR_THREADS * ITERATIONS * 8 / secs / 1e6);
+
+	ret = check_processes(virt);
+
+	munmap(virt, ALLOC_SIZE);
+	if (!anon) {
+		ioctl(fd, BIGCMP_RELEASE);
+		close(fd);
+	}
+	return ret;
+}
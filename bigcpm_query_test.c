@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#include "bigcpm_ioctl.h"
+
+#define MAX_ZONES 64
+
+static const char *verdicts[] = { "no", "compact", "now" };
+
+int main(int argc, char *argv[])
+{
+	char *file_name = "/dev/bigcpm";
+	bigcpm_zone_info_t zones[MAX_ZONES];
+	bigcpm_query_arg_t q;
+	unsigned int i;
+	int fd, c;
+
+	memset(&q, 0, sizeof(q));
+	q.size = 64 * 1024 * 1024;
+	q.node = -1;
+	while ((c = getopt(argc, argv, "s:a:n:gc")) != -1)
+		switch (c) {
+		case 's':	/* size in MB */
+			q.size = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'a':	/* alignment in bytes */
+			q.align = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			q.node = atoi(optarg);
+			break;
+		case 'g':
+			q.flags |= BIGCPM_ALLOC_GIGANTIC;
+			break;
+		case 'c':	/* as for a colored allocation */
+			q.flags |= BIGCPM_ALLOC_COLORED;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s MB] [-a align] [-n node] [-g] [-c]\n",
+				argv[0]);
+			return 1;
+		}
+
+	fd = open(file_name, O_RDWR);
+	if (fd == -1) {
+		perror("apps open");
+		return 2;
+	}
+	q.zones = (unsigned long)zones;
+	q.nzones = MAX_ZONES;
+	if (ioctl(fd, BIGCPM_QUERY, &q) == -1) {
+		printf("BIGCPM_QUERY failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("node zone     free MB  movable MB  free chunks  largest run MB  verdict\n");
+	for (i = 0; i < q.nzones && i < MAX_ZONES; i++)
+		printf("%4d %-8s %8llu  %10llu  %11llu  %14llu  %s\n",
+			zones[i].node, zones[i].name,
+			(unsigned long long)zones[i].free_pages * getpagesize() >> 20,
+			(unsigned long long)zones[i].movable_pages * getpagesize() >> 20,
+			(unsigned long long)zones[i].free_chunks,
+			(unsigned long long)(zones[i].largest_run >> 20),
+			verdicts[zones[i].verdict]);
+	printf("%llu MB: %s (largest free run %llu MB)\n",
+		(unsigned long long)(q.size >> 20), verdicts[q.verdict],
+		(unsigned long long)(q.largest_run >> 20));
+	close(fd);
+	return q.verdict == BIGCPM_QUERY_NO;
+}
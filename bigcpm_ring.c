@@ -0,0 +1,221 @@
+/*
+ * Descriptor rings over the bigcpm mapping. See bigcpm_ring.h.
+ *
+ * Head/tail scheme as in the DPDK rte_ring: a side first moves its head
+ * to claim a run of slots, copies the descriptors, then moves its tail
+ * to hand them over. With several producers (or consumers) each waits
+ * for those that claimed earlier before moving the tail, so the other
+ * side always sees a contiguous run.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bigcpm_ring.h"
+#include "bigcpm_internal.h"
+
+#define TAIL_SPINS	1024	/* waits for an earlier claim before yielding */
+
+static uint64_t slots_offset(void)
+{
+	return ALIGN_UP(sizeof(struct bigcpm_ring_hdr), BIGCPM_RING_CACHELINE);
+}
+
+size_t bigcpm_ring_footprint(uint32_t nr_slots)
+{
+	return slots_offset() + (uint64_t)nr_slots * sizeof(struct bigcpm_ring_desc);
+}
+
+static void ring_bind(struct bigcpm_ring *ring, void *base,
+		struct bigcpm_ring_hdr *hdr)
+{
+	ring->hdr = hdr;
+	ring->slots = (struct bigcpm_ring_desc *)((char *)hdr + slots_offset());
+	ring->base = base;
+	ring->base_phys = hdr->base_phys;
+	ring->mask = hdr->mask;
+	ring->flags = hdr->flags;
+	ring->efd = -1;
+}
+
+int bigcpm_ring_create(struct bigcpm_ring *ring, void *base, size_t base_len,
+		uint64_t base_phys, uint64_t ring_off, uint32_t nr_slots,
+		unsigned int flags)
+{
+	struct bigcpm_ring_hdr *hdr = (struct bigcpm_ring_hdr *)((char *)base + ring_off);
+
+	if (!nr_slots || (nr_slots & (nr_slots - 1)) || nr_slots > (1u << 31) ||
+	    (flags & ~(BIGCPM_RING_MP_ENQ | BIGCPM_RING_MC_DEQ)) ||
+	    ((uintptr_t)hdr & (BIGCPM_RING_CACHELINE - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ring_off > base_len ||
+	    bigcpm_ring_footprint(nr_slots) > base_len - ring_off) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->flags = flags;
+	hdr->mask = nr_slots - 1;
+	hdr->base_phys = base_phys;
+	hdr->ring_off = ring_off;
+	hdr->size = bigcpm_ring_footprint(nr_slots);
+
+	publish_magic(&hdr->magic, BIGCPM_RING_MAGIC);
+	ring_bind(ring, base, hdr);
+	return 0;
+}
+
+int bigcpm_ring_attach(struct bigcpm_ring *ring, void *base, size_t base_len,
+		uint64_t ring_off)
+{
+	struct bigcpm_ring_hdr *hdr = (struct bigcpm_ring_hdr *)((char *)base + ring_off);
+
+	if (ring_off > base_len || base_len - ring_off < sizeof(*hdr) ||
+	    __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != BIGCPM_RING_MAGIC ||
+	    hdr->ring_off != ring_off || hdr->size > base_len - ring_off) {
+		errno = EINVAL;
+		return -1;
+	}
+	ring_bind(ring, base, hdr);
+	return 0;
+}
+
+void bigcpm_ring_set_eventfd(struct bigcpm_ring *ring, int efd)
+{
+	ring->efd = efd;
+}
+
+/*
+ * Claim up to n slots by moving head. limit is the other side's tail,
+ * plus the ring size when claiming free slots. Returns the slot count
+ * and the old head in *old.
+ */
+static unsigned int move_head(uint32_t *head, const uint32_t *limit,
+		uint32_t size, int multi, unsigned int n, uint32_t *old)
+{
+	/* acquire keeps the limit load below from being satisfied before
+	the head load, here and after a failed CAS alike: a weakly ordered
+	CPU could otherwise pair a head with a limit older than it, and
+	avail would wrap around to a huge count */
+	uint32_t h = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+	uint32_t avail;
+
+	do {
+		avail = __atomic_load_n(limit, __ATOMIC_ACQUIRE) + size - h;
+		if (n > avail)
+			n = avail;
+		if (!n)
+			return 0;
+		if (!multi) {
+			__atomic_store_n(head, h + n, __ATOMIC_RELAXED);
+			break;
+		}
+	} while (!__atomic_compare_exchange_n(head, &h, h + n, 1,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	*old = h;
+	return n;
+}
+
+/* Hand the claimed run [old, old + n) over to the other side. If the
+process ahead was preempted between its claim and its tail update, it
+needs our cpu to finish, so stop spinning after a while and yield. */
+static void move_tail(uint32_t *tail, int multi, uint32_t old, unsigned int n)
+{
+	unsigned int spins = 0;
+
+	if (multi)
+		while (__atomic_load_n(tail, __ATOMIC_RELAXED) != old) {
+			if (++spins < TAIL_SPINS)
+				cpu_relax();
+			else
+				sched_yield();
+		}
+	__atomic_store_n(tail, old + n, __ATOMIC_RELEASE);
+}
+
+unsigned int bigcpm_ring_enqueue_burst(struct bigcpm_ring *ring,
+		const struct bigcpm_ring_desc *desc, unsigned int n)
+{
+	struct bigcpm_ring_hdr *hdr = ring->hdr;
+	int multi = ring->flags & BIGCPM_RING_MP_ENQ;
+	uint32_t head;
+	unsigned int i;
+
+	n = move_head(&hdr->prod_head, &hdr->cons_tail, ring->mask + 1,
+			multi, n, &head);
+	for (i = 0; i < n; i++)
+		ring->slots[(head + i) & ring->mask] = desc[i];
+	if (n)
+		move_tail(&hdr->prod_tail, multi, head, n);
+
+	/* pairs with the fence in bigcpm_ring_wait() */
+	if (n && ring->efd >= 0) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&hdr->waiters, __ATOMIC_RELAXED)) {
+			uint64_t one = 1;
+			ssize_t ret;
+
+			/* EAGAIN only when the counter is saturated,
+			i.e. already readable */
+			ret = write(ring->efd, &one, sizeof(one));
+			(void)ret;
+		}
+	}
+	return n;
+}
+
+unsigned int bigcpm_ring_dequeue_burst(struct bigcpm_ring *ring,
+		struct bigcpm_ring_desc *desc, unsigned int n)
+{
+	struct bigcpm_ring_hdr *hdr = ring->hdr;
+	int multi = ring->flags & BIGCPM_RING_MC_DEQ;
+	uint32_t head;
+	unsigned int i;
+
+	n = move_head(&hdr->cons_head, &hdr->prod_tail, 0, multi, n, &head);
+	for (i = 0; i < n; i++)
+		desc[i] = ring->slots[(head + i) & ring->mask];
+	if (n)
+		move_tail(&hdr->cons_tail, multi, head, n);
+	return n;
+}
+
+int bigcpm_ring_wait(struct bigcpm_ring *ring, int timeout_ms)
+{
+	struct bigcpm_ring_hdr *hdr = ring->hdr;
+	struct pollfd pfd = { .fd = ring->efd, .events = POLLIN };
+	uint64_t count;
+	int ret = 0;
+
+	if (bigcpm_ring_count(ring))
+		return 0;
+	if (ring->efd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * Announce the sleep, then look again: a producer either sees the
+	 * waiter count or its descriptors are seen here.
+	 */
+	__atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!bigcpm_ring_count(ring)) {
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret > 0 && read(ring->efd, &count, sizeof(count)) < 0 &&
+		    errno != EAGAIN)
+			ret = -1;
+		else if (ret == 0) {
+			errno = ETIMEDOUT;
+			ret = -1;
+		}
+	}
+	__atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_RELAXED);
+	return ret < 0 ? -1 : 0;
+}
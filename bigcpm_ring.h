@@ -0,0 +1,134 @@
+#ifndef BIGCPM_RING_H
+#define BIGCPM_RING_H
+
+/*
+ * Descriptor rings inside the mmapped /dev/bigcpm region.
+ *
+ * A ring is a power-of-two array of fixed-size descriptors plus producer
+ * and consumer indices, all stored in the region, so any process that
+ * maps the same bigcpm buffer can attach to it; a device can read the
+ * same descriptors through the buffer's physical address. Descriptors
+ * name their payload by offset from the start of the buffer and by
+ * physical address, so neither side has to translate.
+ *
+ * Each side has a head (slots claimed) and a tail (slots finished) on
+ * its own cache line. A single producer or consumer just moves its head;
+ * with BIGCPM_RING_MP_ENQ / BIGCPM_RING_MC_DEQ the head is claimed with a
+ * CAS and tails are published in claim order. Whole bursts are claimed
+ * at once, so batching amortizes the shared cache line traffic.
+ *
+ * An eventfd can be attached for the idle case: a consumer with nothing
+ * to do sleeps in bigcpm_ring_wait(), and producers only write to the
+ * eventfd while a consumer says it is waiting.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BIGCPM_RING_MAGIC	0x6272696eu	/* "brin" */
+#define BIGCPM_RING_CACHELINE	64
+
+/* bigcpm_ring_create() flags */
+#define BIGCPM_RING_MP_ENQ	0x1	/* several producers */
+#define BIGCPM_RING_MC_DEQ	0x2	/* several consumers */
+
+struct bigcpm_ring_desc {
+	uint64_t off;		/* payload, from the start of the buffer */
+	uint64_t phys;		/* payload physical address */
+	uint32_t len;		/* payload bytes */
+	uint32_t flags;		/* free for the application */
+	uint64_t cookie;	/* free for the application */
+};
+
+/* Shared state, placed at ring_off inside the buffer; slots follow it. */
+struct bigcpm_ring_hdr {
+	uint32_t magic;
+	uint32_t flags;		/* BIGCPM_RING_* */
+	uint32_t mask;		/* slots - 1 */
+	uint32_t reserved;
+	uint64_t base_phys;	/* physical address of the buffer */
+	uint64_t ring_off;	/* this header, from the start of the buffer */
+	uint64_t size;		/* bytes used by header and slots */
+
+	uint32_t prod_head __attribute__((aligned(BIGCPM_RING_CACHELINE)));
+	uint32_t prod_tail;
+	uint32_t cons_head __attribute__((aligned(BIGCPM_RING_CACHELINE)));
+	uint32_t cons_tail;
+	uint32_t waiters __attribute__((aligned(BIGCPM_RING_CACHELINE)));
+} __attribute__((aligned(BIGCPM_RING_CACHELINE)));
+
+/* Process-local handle on a ring. */
+struct bigcpm_ring {
+	struct bigcpm_ring_hdr *hdr;
+	struct bigcpm_ring_desc *slots;
+	char *base;		/* this process's mapping of the buffer */
+	uint64_t base_phys;
+	uint32_t mask;
+	uint32_t flags;
+	int efd;		/* eventfd for wakeups, -1 if none */
+};
+
+/* Bytes of region needed for a ring of nr_slots descriptors. */
+size_t bigcpm_ring_footprint(uint32_t nr_slots);
+
+/*
+ * Format a new, empty ring of nr_slots (a power of two) at ring_off
+ * inside the buffer mapped at base, whose physical address is base_phys.
+ * Returns 0, or -1 with errno set.
+ */
+int bigcpm_ring_create(struct bigcpm_ring *ring, void *base, size_t base_len,
+		uint64_t base_phys, uint64_t ring_off, uint32_t nr_slots,
+		unsigned int flags);
+
+/*
+ * Attach to a ring created by another thread or process in the same
+ * buffer. Returns 0, or -1 with errno set.
+ */
+int bigcpm_ring_attach(struct bigcpm_ring *ring, void *base, size_t base_len,
+		uint64_t ring_off);
+
+/*
+ * Use efd for wakeups: an eventfd(2) made with EFD_NONBLOCK and shared
+ * through fork or SCM_RIGHTS. Both sides of the ring need to set it.
+ */
+void bigcpm_ring_set_eventfd(struct bigcpm_ring *ring, int efd);
+
+/* Enqueue up to n descriptors; returns the number enqueued. */
+unsigned int bigcpm_ring_enqueue_burst(struct bigcpm_ring *ring,
+		const struct bigcpm_ring_desc *desc, unsigned int n);
+
+/* Dequeue up to n descriptors; returns the number dequeued. */
+unsigned int bigcpm_ring_dequeue_burst(struct bigcpm_ring *ring,
+		struct bigcpm_ring_desc *desc, unsigned int n);
+
+/*
+ * Sleep until the ring is not empty or timeout_ms (-1 = forever) has
+ * passed. Returns 0, or -1 with errno set (ETIMEDOUT, or EINVAL without
+ * an eventfd).
+ */
+int bigcpm_ring_wait(struct bigcpm_ring *ring, int timeout_ms);
+
+/* Descriptors ready to dequeue. */
+static inline unsigned int bigcpm_ring_count(const struct bigcpm_ring *ring)
+{
+	return __atomic_load_n(&ring->hdr->prod_tail, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&ring->hdr->cons_head, __ATOMIC_RELAXED);
+}
+
+/* Point desc at len bytes at payload, which must lie in the buffer. */
+static inline void bigcpm_ring_desc_set(const struct bigcpm_ring *ring,
+		struct bigcpm_ring_desc *desc, const void *payload, uint32_t len)
+{
+	desc->off = (uint64_t)((const char *)payload - ring->base);
+	desc->phys = ring->base_phys + desc->off;
+	desc->len = len;
+}
+
+/* This process's address of a descriptor's payload. */
+static inline void *bigcpm_ring_desc_virt(const struct bigcpm_ring *ring,
+		const struct bigcpm_ring_desc *desc)
+{
+	return ring->base + desc->off;
+}
+
+#endif
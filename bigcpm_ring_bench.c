@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include "bigcpm_ioctl.h"
+#include "bigcpm_ring.h"
+
+#define ALLOC_SIZE (16*1024*1024)
+#define NR_SLOTS   1024
+#define PAYLOAD    2048
+#define MAX_BURST  32
+
+static const unsigned int bursts[] = { 1, 8, MAX_BURST };
+
+static int prod_cpu = -1, cons_cpu = -1;
+static unsigned int ring_flags;
+static unsigned int nr_procs = 1;	/* producers, and as many consumers */
+static int use_eventfd;
+static uint64_t nr_descs = 10000000;
+static uint64_t payload_off;
+static unsigned int nr_payloads;
+
+/*
+ * Shared by all the processes of a run. With several consumers there is
+ * no global order to check, so each cookie sets its bit in seen, and
+ * a bit that was already set is a duplicate; the parent checks for
+ * missing ones at the end.
+ */
+struct tally {
+	uint64_t consumed;	/* descriptors dequeued so far */
+	uint32_t failed;	/* a consumer found a bad descriptor */
+	uint64_t seen[];
+};
+static struct tally *tally;
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		perror("sched_setaffinity");
+}
+
+static int failed(void)
+{
+	return __atomic_load_n(&tally->failed, __ATOMIC_RELAXED);
+}
+
+/* Report a bad descriptor and make every process of the run stop. */
+static int fail(const char *what, uint64_t cookie)
+{
+	printf("descriptor %llu %s\n", (unsigned long long)cookie, what);
+	__atomic_store_n(&tally->failed, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* Child: drain the ring and check that every descriptor arrives once,
+and in order when there is only one producer and one consumer. */
+static int consumer(char *virt, unsigned int burst, int efd, unsigned int id)
+{
+	struct bigcpm_ring_desc d[MAX_BURST];
+	struct bigcpm_ring ring;
+	uint64_t expect = 0, cookie, bit;
+	unsigned int i, n;
+
+	pin(cons_cpu < 0 ? -1 : cons_cpu + (int)id);
+	if (bigcpm_ring_attach(&ring, virt, ALLOC_SIZE, 0) == -1) {
+		printf("bigcpm_ring_attach failed: %s\n", strerror(errno));
+		return 1;
+	}
+	bigcpm_ring_set_eventfd(&ring, efd);
+	while (__atomic_load_n(&tally->consumed, __ATOMIC_RELAXED) < nr_descs &&
+	       !failed()) {
+		n = bigcpm_ring_dequeue_burst(&ring, d, burst);
+		if (!n && use_eventfd)
+			bigcpm_ring_wait(&ring, 100);
+		else if (!n)
+			sched_yield();	/* in case both ends share a cpu */
+		for (i = 0; i < n; i++) {
+			cookie = d[i].cookie;
+			if (cookie >= nr_descs ||
+			    *(uint64_t *)bigcpm_ring_desc_virt(&ring, &d[i]) != cookie)
+				return fail("corrupted", cookie);
+			if (nr_procs == 1) {
+				if (cookie != expect++)
+					return fail("out of order", cookie);
+				continue;
+			}
+			bit = 1ULL << (cookie % 64);
+			if (__atomic_fetch_or(&tally->seen[cookie / 64], bit,
+					__ATOMIC_RELAXED) & bit)
+				return fail("seen twice", cookie);
+		}
+		if (n)
+			__atomic_add_fetch(&tally->consumed, n, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/*
+ * Child: send cookies id, id + nr_procs, id + 2 * nr_procs ... Each
+ * producer cycles through its own share of the payloads, and a share
+ * holds more payloads than can be in flight at once, so a payload is
+ * never rewritten before its consumer has checked it.
+ */
+static int producer(char *virt, unsigned int burst, int efd, unsigned int id)
+{
+	struct bigcpm_ring_desc d[MAX_BURST];
+	struct bigcpm_ring ring;
+	unsigned int share = nr_payloads / nr_procs;
+	uint64_t k = 0, cookie;
+	unsigned int i, n;
+
+	pin(prod_cpu < 0 ? -1 : prod_cpu + (int)id);
+	if (bigcpm_ring_attach(&ring, virt, ALLOC_SIZE, 0) == -1) {
+		printf("bigcpm_ring_attach failed: %s\n", strerror(errno));
+		return 1;
+	}
+	bigcpm_ring_set_eventfd(&ring, efd);
+	while (k * nr_procs + id < nr_descs && !failed()) {
+		for (n = 0; n < burst; n++) {
+			char *p;
+
+			cookie = (k + n) * nr_procs + id;
+			if (cookie >= nr_descs)
+				break;
+			p = virt + payload_off +
+				((size_t)id * share + (k + n) % share) * PAYLOAD;
+			*(uint64_t *)p = cookie;
+			bigcpm_ring_desc_set(&ring, &d[n], p, PAYLOAD);
+			d[n].cookie = cookie;
+		}
+		i = bigcpm_ring_enqueue_burst(&ring, d, n);
+		if (!i)
+			sched_yield();
+		k += i;
+	}
+	return 0;
+}
+
+/* Cookies no consumer has seen, with several consumers. */
+static uint64_t missing(void)
+{
+	uint64_t c, count = 0;
+
+	if (nr_procs == 1)
+		return 0;
+	for (c = 0; c < nr_descs; c++)
+		if (!(tally->seen[c / 64] & (1ULL << (c % 64))))
+			count++;
+	return count;
+}
+
+/* Returns nonzero if a process failed or a descriptor went missing. */
+static int run(char *virt, uint64_t phys, unsigned int burst)
+{
+	struct bigcpm_ring ring;
+	struct timespec t0, t1;
+	unsigned int i, bad = 0;
+	uint64_t lost;
+	double secs;
+	int efd = -1, status;
+	pid_t pid;
+
+	if (bigcpm_ring_create(&ring, virt, ALLOC_SIZE, phys, 0, NR_SLOTS,
+			ring_flags) == -1) {
+		printf("bigcpm_ring_create failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (use_eventfd)
+		efd = eventfd(0, EFD_NONBLOCK);
+	memset(tally, 0, sizeof(*tally) + (nr_descs + 63) / 64 * sizeof(uint64_t));
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < 2 * nr_procs; i++) {
+		pid = fork();
+		if (pid == 0)
+			exit(i < nr_procs ? consumer(virt, burst, efd, i) :
+				producer(virt, burst, efd, i - nr_procs));
+		if (pid == -1) {
+			perror("fork");
+			exit(1);
+		}
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			bad++;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (efd >= 0)
+		close(efd);
+	lost = bad ? 0 : missing();
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%s", ring_flags ? "mpmc" : "spsc");
+	if (nr_procs > 1)
+		printf(" x%u", nr_procs);
+	printf(" burst %2u%s: %.1f M desc/s", burst,
+		use_eventfd ? " eventfd" : "", nr_descs / secs / 1e6);
+	if (bad)
+		printf(" (%u processes failed)", bad);
+	else if (lost)
+		printf(" (%llu descriptors lost)", (unsigned long long)lost);
+	printf("\n");
+	return bad || lost;
+}
+
+int main(int argc, char *argv[])
+{
+	char *file_name = "/dev/bigcpm";
+	bigcpm_arg_t q;
+	uint64_t phys = 0;
+	char *virt;
+	int anon = 0;
+	int fd = -1, c, bad = 0;
+	unsigned int i;
+
+	while ((c = getopt(argc, argv, "am:en:p:c:")) != -1)
+		switch (c) {
+		case 'a':	/* anonymous shared memory, no driver needed */
+			anon = 1;
+			break;
+		case 'm':	/* processes on each side */
+			ring_flags = BIGCPM_RING_MP_ENQ | BIGCPM_RING_MC_DEQ;
+			nr_procs = atoi(optarg);
+			break;
+		case 'e':
+			use_eventfd = 1;
+			break;
+		case 'n':
+			nr_descs = strtoull(optarg, NULL, 0) * 1000000;
+			break;
+		case 'p':
+			prod_cpu = atoi(optarg);
+			break;
+		case 'c':
+			cons_cpu = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a] [-m procs] [-e] [-n Mdesc] [-p cpu] [-c cpu]\n",
+				argv[0]);
+			return 1;
+		}
+
+	payload_off = bigcpm_ring_footprint(NR_SLOTS);
+	payload_off = (payload_off + PAYLOAD - 1) / PAYLOAD * PAYLOAD;
+	nr_payloads = (ALLOC_SIZE - payload_off) / PAYLOAD;
+	/* a full ring, a burst held by every consumer and one being built */
+	if (!nr_procs || nr_payloads / nr_procs <=
+	    NR_SLOTS + (nr_procs + 1) * MAX_BURST) {
+		fprintf(stderr, "-m: %u processes per side is too many\n", nr_procs);
+		return 1;
+	}
+	tally = mmap(0, sizeof(*tally) + (nr_descs + 63) / 64 * sizeof(uint64_t),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (tally == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (anon) {
+		virt = mmap(0, ALLOC_SIZE, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	} else {
+		fd = open(file_name, O_RDWR);
+		if (fd == -1) {
+			perror("apps open");
+			return 2;
+		}
+		q.size = ALLOC_SIZE;
+		if (ioctl(fd, BIGCPM_ALLOC, &q) == -1) {
+			printf("BIGCPM_ALLOC, failed: %s\n", strerror(errno));
+			return 1;
+		}
+		if (ioctl(fd, BIGCMP_GET_PHYSADDR, &q) == -1) {
+			printf("BIGCMP_GET_PHYSADDR failed: %s\n", strerror(errno));
+			return 1;
+		}
+		phys = q.paddr;
+		virt = mmap(0, ALLOC_SIZE, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_LOCKED, fd, 0);
+	}
+	if (virt == MAP_FAILED) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++)
+		bad |= run(virt, phys, bursts[i]);
+
+	munmap(virt, ALLOC_SIZE);
+	if (!anon) {
+		ioctl(fd, BIGCMP_RELEASE);
+		close(fd);
+	}
+	return bad;
+}